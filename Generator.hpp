@@ -0,0 +1,114 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+// Lazily produced sequence of T, driven by a coroutine that co_yields each
+// element. Only the element currently yielded is alive at any time.
+template<typename T>
+class Generator {
+public:
+    using Value = std::remove_reference_t<T>;
+
+    struct promise_type {
+        Value* Current = nullptr;
+        std::exception_ptr Error;
+
+        Generator get_return_object() {
+            return Generator(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept { return { }; }
+        std::suspend_always final_suspend() noexcept { return { }; }
+
+        // The yielded object outlives the suspension, so pointing at it is enough
+        std::suspend_always yield_value(Value& Val) noexcept {
+            Current = std::addressof(Val);
+            return { };
+        }
+        std::suspend_always yield_value(Value&& Val) noexcept {
+            Current = std::addressof(Val);
+            return { };
+        }
+
+        void return_void() { }
+
+        void unhandled_exception() {
+            Error = std::current_exception();
+        }
+
+        // Generators cannot co_await anything
+        template<typename U>
+        std::suspend_never await_transform(U&&) = delete;
+    };
+
+    struct Sentinel { };
+
+    class Iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using difference_type = std::ptrdiff_t;
+        using value_type = Value;
+        using reference = Value&;
+        using pointer = Value*;
+
+        Iterator() = default;
+        explicit Iterator(std::coroutine_handle<promise_type> Handle)
+        : Handle(Handle) { }
+
+        Iterator& operator++() {
+            Advance(Handle);
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+
+        Value& operator*() const { return *Handle.promise().Current; }
+        Value* operator->() const { return Handle.promise().Current; }
+
+        bool operator==(Sentinel) const { return !Handle || Handle.done(); }
+
+    private:
+        std::coroutine_handle<promise_type> Handle;
+    };
+
+    Generator(Generator&& Rhs) noexcept
+    : Handle(std::exchange(Rhs.Handle, nullptr)) { }
+
+    Generator& operator=(Generator&& Rhs) noexcept {
+        if (this != &Rhs) {
+            if (Handle) Handle.destroy();
+            Handle = std::exchange(Rhs.Handle, nullptr);
+        }
+        return *this;
+    }
+
+    ~Generator() {
+        if (Handle) Handle.destroy();
+    }
+
+    // Starts the coroutine, so errors before the first element surface here
+    Iterator begin() {
+        Advance(Handle);
+        return Iterator(Handle);
+    }
+
+    Sentinel end() { return { }; }
+
+private:
+    std::coroutine_handle<promise_type> Handle;
+
+    explicit Generator(std::coroutine_handle<promise_type> Handle)
+    : Handle(Handle) { }
+
+    static void Advance(std::coroutine_handle<promise_type> Handle) {
+        if (!Handle || Handle.done()) return;
+        Handle.resume();
+        if (Handle.promise().Error) {
+            std::rethrow_exception(std::exchange(Handle.promise().Error, nullptr));
+        }
+    }
+};
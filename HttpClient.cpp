@@ -0,0 +1,168 @@
+#include "HttpClient.hpp"
+
+#include <cctype>
+
+static size_t AppendBody(void* Contents, size_t Size, size_t Count, void* User) {
+    static_cast<std::string*>(User)->append(static_cast<char*>(Contents), Size * Count);
+    return Size * Count;
+}
+
+size_t HttpResponse::CollectHeader(char* Contents, size_t Size, size_t Count, void* User) {
+    HttpResponse& Res = *static_cast<HttpResponse*>(User);
+    std::string_view Line(Contents, Size * Count);
+
+    // Each status line starts a new response, after a redirect or 100 Continue
+    if (Line.starts_with("HTTP/")) {
+        Res.Headers.clear();
+        return Size * Count;
+    }
+
+    size_t Colon = Line.find(':');
+    if (Colon == std::string_view::npos) return Size * Count;
+
+    std::string Name(Line.substr(0, Colon));
+    for (char& C : Name) C = std::tolower(static_cast<unsigned char>(C));
+
+    std::string_view Value = Line.substr(Colon + 1);
+    while (!Value.empty() && std::isspace(static_cast<unsigned char>(Value.front()))) Value.remove_prefix(1);
+    while (!Value.empty() && std::isspace(static_cast<unsigned char>(Value.back()))) Value.remove_suffix(1);
+    Res.Headers[Name] = std::string(Value);
+    return Size * Count;
+}
+
+void EventStreamParser::Feed(std::string_view Bytes) {
+    Pending.append(Bytes);
+
+    size_t Begin = 0;
+    while (true) {
+        size_t End = Pending.find('\n', Begin);
+        if (End == std::string::npos) break;
+        size_t LineEnd = (End > Begin && Pending[End - 1] == '\r') ? End - 1 : End;
+        Line(std::string_view(Pending).substr(Begin, LineEnd - Begin));
+        Begin = End + 1;
+    }
+    Pending.erase(0, Begin);
+}
+
+void EventStreamParser::Line(std::string_view Text) {
+    // A blank line ends the event
+    if (Text.empty()) {
+        if (HasData && OnEvent) OnEvent(Data);
+        Data.clear();
+        HasData = false;
+        return;
+    }
+
+    if (!Text.starts_with("data:")) return;
+    Text.remove_prefix(5);
+    if (Text.starts_with(" ")) Text.remove_prefix(1);
+
+    if (HasData) Data.push_back('\n');
+    Data.append(Text);
+    HasData = true;
+}
+
+HttpHeaders::HttpHeaders(std::vector<std::string> const& Lines) {
+    for (std::string const& Line : Lines) {
+        Append(Line);
+    }
+}
+
+HttpHeaders::~HttpHeaders() {
+    curl_slist_free_all(List);
+}
+
+void HttpHeaders::Append(std::string const& Line) {
+    List = curl_slist_append(List, Line.c_str());
+}
+
+HttpClient::HttpClient(Options Opts)
+: Opts(Opts) {
+    // Not thread safe in older libcurl, so done once before any handle exists
+    static std::once_flag GlobalInit;
+    std::call_once(GlobalInit, []() {
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+    });
+
+    Share = curl_share_init();
+    curl_share_setopt(Share, CURLSHOPT_LOCKFUNC, LockShare);
+    curl_share_setopt(Share, CURLSHOPT_UNLOCKFUNC, UnlockShare);
+    curl_share_setopt(Share, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(Share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(Share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+HttpClient::~HttpClient() {
+    // Handles must let go of the share before it can be cleaned up
+    for (CURL* Handle : Idle) {
+        curl_easy_cleanup(Handle);
+    }
+    curl_share_cleanup(Share);
+}
+
+void HttpClient::LockShare(CURL* Handle, curl_lock_data Data, curl_lock_access Access, void* User) {
+    static_cast<HttpClient*>(User)->ShareLocks[Data].lock();
+}
+
+void HttpClient::UnlockShare(CURL* Handle, curl_lock_data Data, void* User) {
+    static_cast<HttpClient*>(User)->ShareLocks[Data].unlock();
+}
+
+CURL* HttpClient::Acquire() {
+    CURL* Handle = nullptr;
+    {
+        std::lock_guard<std::mutex> Lock(PoolMutex);
+        if (!Idle.empty()) {
+            Handle = Idle.back();
+            Idle.pop_back();
+        }
+    }
+    if (!Handle) {
+        Handle = curl_easy_init();
+        if (!Handle) return nullptr;
+    }
+
+    curl_easy_setopt(Handle, CURLOPT_SHARE, Share);
+    curl_easy_setopt(Handle, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(Handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(Handle, CURLOPT_CONNECTTIMEOUT_MS, Opts.ConnectTimeoutMs);
+    curl_easy_setopt(Handle, CURLOPT_TIMEOUT_MS, Opts.TimeoutMs);
+    curl_easy_setopt(Handle, CURLOPT_ACCEPT_ENCODING, "");
+    return Handle;
+}
+
+void HttpClient::Release(CURL* Handle) {
+    // Reset clears the options but keeps the handle's connections and caches
+    curl_easy_reset(Handle);
+
+    std::lock_guard<std::mutex> Lock(PoolMutex);
+    if (Idle.size() < Opts.MaxIdleHandles) {
+        Idle.push_back(Handle);
+    } else {
+        curl_easy_cleanup(Handle);
+    }
+}
+
+HttpResponse HttpClient::Post(std::string const& URL, HttpHeaders const& Headers, std::string const& Body) {
+    HttpResponse Res;
+    CURL* Handle = Acquire();
+    if (!Handle) {
+        Res.Result = CURLE_FAILED_INIT;
+        return Res;
+    }
+
+    curl_easy_setopt(Handle, CURLOPT_URL, URL.c_str());
+    curl_easy_setopt(Handle, CURLOPT_HTTPHEADER, Headers.Get());
+    curl_easy_setopt(Handle, CURLOPT_POSTFIELDS, Body.data());
+    curl_easy_setopt(Handle, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(Body.size()));
+    curl_easy_setopt(Handle, CURLOPT_WRITEFUNCTION, AppendBody);
+    curl_easy_setopt(Handle, CURLOPT_WRITEDATA, &Res.Body);
+    curl_easy_setopt(Handle, CURLOPT_HEADERFUNCTION, HttpResponse::CollectHeader);
+    curl_easy_setopt(Handle, CURLOPT_HEADERDATA, &Res);
+
+    Res.Result = curl_easy_perform(Handle);
+    curl_easy_getinfo(Handle, CURLINFO_RESPONSE_CODE, &Res.Status);
+
+    Release(Handle);
+    return Res;
+}
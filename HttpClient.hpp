@@ -0,0 +1,111 @@
+#pragma once
+
+#include <array>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <curl/curl.h>
+
+struct HttpResponse {
+    CURLcode Result = CURLE_OK;
+    long Status = 0;
+    std::string Body;
+
+    // Names are lower case. Only the final response's, if there were several.
+    std::map<std::string, std::string> Headers;
+
+    // The exchange completed, whatever the status code
+    bool Ok() const { return Result == CURLE_OK; }
+
+    // Empty if missing. Name must be lower case.
+    std::string Header(std::string const& Name) const {
+        auto Found = Headers.find(Name);
+        return Found == Headers.end() ? std::string() : Found->second;
+    }
+
+    // CURLOPT_HEADERFUNCTION filling Headers, with the response as its data
+    static size_t CollectHeader(char* Contents, size_t Size, size_t Count, void* User);
+};
+
+// Splits a text/event-stream body into events as it arrives, in whatever
+// pieces the network delivers it. Only data fields are kept; OnEvent gets
+// each event's data lines joined by newlines.
+class EventStreamParser {
+public:
+    std::function<void(std::string_view)> OnEvent;
+
+    void Feed(std::string_view Bytes);
+
+private:
+    std::string Pending;
+    std::string Data;
+    bool HasData = false;
+
+    void Line(std::string_view Text);
+};
+
+// Header list built once and passed to every request that needs it
+class HttpHeaders {
+public:
+    HttpHeaders() = default;
+    HttpHeaders(std::vector<std::string> const& Lines);
+    ~HttpHeaders();
+
+    HttpHeaders(HttpHeaders const&) = delete;
+    HttpHeaders& operator=(HttpHeaders const&) = delete;
+
+    void Append(std::string const& Line);
+
+    curl_slist* Get() const { return List; }
+
+private:
+    curl_slist* List = nullptr;
+};
+
+// Long lived libcurl state. A share handle caches DNS lookups and TLS
+// sessions between requests, and finished easy handles are kept for the next
+// request instead of being cleaned up, along with the connections they hold.
+// Open connections are not shared, as libcurl does not support sharing them
+// between threads; an HttpEngine keeps its own for its thread. Post may be
+// called from any thread.
+class HttpClient {
+public:
+    struct Options {
+        long ConnectTimeoutMs = 10000;
+        long TimeoutMs = 120000;
+
+        // Idle easy handles kept beyond this are cleaned up
+        size_t MaxIdleHandles = 16;
+    };
+
+    HttpClient() : HttpClient(Options()) { }
+    HttpClient(Options Opts);
+    ~HttpClient();
+
+    HttpClient(HttpClient const&) = delete;
+    HttpClient& operator=(HttpClient const&) = delete;
+
+    HttpResponse Post(std::string const& URL, HttpHeaders const& Headers, std::string const& Body);
+
+private:
+    // Drives the pooled handles itself
+    friend class HttpEngine;
+
+    const Options Opts;
+
+    CURLSH* Share = nullptr;
+    std::array<std::mutex, CURL_LOCK_DATA_LAST> ShareLocks;
+
+    std::mutex PoolMutex;
+    std::vector<CURL*> Idle;
+
+    static void LockShare(CURL* Handle, curl_lock_data Data, curl_lock_access Access, void* User);
+    static void UnlockShare(CURL* Handle, curl_lock_data Data, void* User);
+
+    CURL* Acquire();
+    void Release(CURL* Handle);
+};
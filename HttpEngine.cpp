@@ -0,0 +1,197 @@
+#include "HttpEngine.hpp"
+
+static size_t AppendBody(void* Contents, size_t Size, size_t Count, void* User) {
+    static_cast<std::string*>(User)->append(static_cast<char*>(Contents), Size * Count);
+    return Size * Count;
+}
+
+static size_t StreamBody(void* Contents, size_t Size, size_t Count, void* User) {
+    std::function<bool(std::string_view)>& OnData = *static_cast<std::function<bool(std::string_view)>*>(User);
+    return OnData(std::string_view(static_cast<char*>(Contents), Size * Count)) ? Size * Count : 0;
+}
+
+// Scheme, host and port, which is what limits are counted per
+static std::string HostOf(std::string const& URL) {
+    size_t Begin = URL.find("://");
+    Begin = (Begin == std::string::npos) ? 0 : Begin + 3;
+    size_t End = URL.find_first_of("/?#", Begin);
+    return URL.substr(0, End);
+}
+
+HttpEngine::HttpEngine(HttpClient& Client, Options Opts)
+: Client(Client), Opts(Opts), Multi(curl_multi_init()) {
+    Loop = std::thread([this]() {
+        Run();
+    });
+}
+
+HttpEngine::~HttpEngine() {
+    {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        Stopping = true;
+    }
+    curl_multi_wakeup(Multi);
+    Loop.join();
+    curl_multi_cleanup(Multi);
+}
+
+void HttpEngine::Submit(HttpRequest Request, Callback Done) {
+    std::unique_ptr<Transfer> Item(new Transfer { std::move(Request), std::move(Done) });
+    Item->Host = HostOf(Item->Request.URL);
+
+    {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        if (!Stopping) {
+            Submitted.push_back(std::move(Item));
+        }
+    }
+
+    if (Item) {
+        Item->Response.Result = CURLE_ABORTED_BY_CALLBACK;
+        Item->Done(Item->Response);
+        return;
+    }
+    curl_multi_wakeup(Multi);
+}
+
+std::future<HttpResponse> HttpEngine::Submit(HttpRequest Request) {
+    std::shared_ptr<std::promise<HttpResponse>> Promise = std::make_shared<std::promise<HttpResponse>>();
+    std::future<HttpResponse> Res = Promise->get_future();
+    Submit(std::move(Request), [Promise](HttpResponse& Response) {
+        Promise->set_value(std::move(Response));
+    });
+    return Res;
+}
+
+void HttpEngine::Prewarm(std::string const& URL, size_t Connections) {
+    // In flight together, so each has to open its own connection
+    std::vector<std::future<HttpResponse>> Pending;
+    for (size_t i = 0; i < Connections; ++i) {
+        HttpRequest Request { URL };
+        Request.HeadOnly = true;
+        Pending.push_back(Submit(std::move(Request)));
+    }
+    for (std::future<HttpResponse>& Done : Pending) {
+        Done.wait();
+    }
+}
+
+void HttpEngine::Run() {
+    while (true) {
+        std::deque<std::unique_ptr<Transfer>> New;
+        {
+            std::lock_guard<std::mutex> Lock(Mutex);
+            if (Stopping) break;
+            New.swap(Submitted);
+        }
+        for (std::unique_ptr<Transfer>& Item : New) {
+            Hosts[Item->Host].Waiting.push_back(std::move(Item));
+        }
+        StartReady();
+
+        int Active = 0;
+        curl_multi_perform(Multi, &Active);
+
+        bool Finished = false;
+        int Left = 0;
+        while (CURLMsg* Message = curl_multi_info_read(Multi, &Left)) {
+            if (Message->msg == CURLMSG_DONE) {
+                Finish(Message->easy_handle, Message->data.result);
+                Finished = true;
+            }
+        }
+
+        // Finishing frees slots, so start the next requests before sleeping
+        if (!Finished) {
+            curl_multi_poll(Multi, nullptr, 0, 1000, nullptr);
+        }
+    }
+    Abort();
+}
+
+void HttpEngine::StartReady() {
+    for (auto& [Name, State] : Hosts) {
+        while (State.Active < Opts.MaxPerHost && !State.Waiting.empty()) {
+            std::unique_ptr<Transfer> Item = std::move(State.Waiting.front());
+            State.Waiting.pop_front();
+            Start(std::move(Item));
+        }
+    }
+}
+
+void HttpEngine::Start(std::unique_ptr<Transfer> Item) {
+    CURL* Handle = Client.Acquire();
+    if (!Handle) {
+        Item->Response.Result = CURLE_FAILED_INIT;
+        Item->Done(Item->Response);
+        return;
+    }
+
+    curl_easy_setopt(Handle, CURLOPT_URL, Item->Request.URL.c_str());
+    if (Item->Request.Headers) {
+        curl_easy_setopt(Handle, CURLOPT_HTTPHEADER, Item->Request.Headers->Get());
+    }
+    if (Item->Request.HeadOnly) {
+        curl_easy_setopt(Handle, CURLOPT_NOBODY, 1L);
+    } else {
+        curl_easy_setopt(Handle, CURLOPT_POSTFIELDS, Item->Request.Body.data());
+        curl_easy_setopt(Handle, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(Item->Request.Body.size()));
+    }
+    if (Item->Request.OnData) {
+        curl_easy_setopt(Handle, CURLOPT_WRITEFUNCTION, StreamBody);
+        curl_easy_setopt(Handle, CURLOPT_WRITEDATA, &Item->Request.OnData);
+    } else {
+        curl_easy_setopt(Handle, CURLOPT_WRITEFUNCTION, AppendBody);
+        curl_easy_setopt(Handle, CURLOPT_WRITEDATA, &Item->Response.Body);
+    }
+    curl_easy_setopt(Handle, CURLOPT_HEADERFUNCTION, HttpResponse::CollectHeader);
+    curl_easy_setopt(Handle, CURLOPT_HEADERDATA, &Item->Response);
+
+    Item->Handle = Handle;
+    Hosts[Item->Host].Active++;
+    curl_multi_add_handle(Multi, Handle);
+    Running.emplace(Handle, std::move(Item));
+}
+
+void HttpEngine::Finish(CURL* Handle, CURLcode Result) {
+    auto Found = Running.find(Handle);
+    if (Found == Running.end()) return;
+    std::unique_ptr<Transfer> Item = std::move(Found->second);
+    Running.erase(Found);
+
+    Item->Response.Result = Result;
+    curl_easy_getinfo(Handle, CURLINFO_RESPONSE_CODE, &Item->Response.Status);
+    curl_multi_remove_handle(Multi, Handle);
+    Client.Release(Handle);
+    Hosts[Item->Host].Active--;
+
+    Item->Done(Item->Response);
+}
+
+void HttpEngine::Abort() {
+    std::vector<std::unique_ptr<Transfer>> Dropped;
+    for (auto& [Handle, Item] : Running) {
+        curl_multi_remove_handle(Multi, Handle);
+        Client.Release(Handle);
+        Dropped.push_back(std::move(Item));
+    }
+    Running.clear();
+    for (auto& [Name, State] : Hosts) {
+        for (std::unique_ptr<Transfer>& Item : State.Waiting) {
+            Dropped.push_back(std::move(Item));
+        }
+    }
+    Hosts.clear();
+    {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        for (std::unique_ptr<Transfer>& Item : Submitted) {
+            Dropped.push_back(std::move(Item));
+        }
+        Submitted.clear();
+    }
+
+    for (std::unique_ptr<Transfer>& Item : Dropped) {
+        Item->Response.Result = CURLE_ABORTED_BY_CALLBACK;
+        Item->Done(Item->Response);
+    }
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+
+#include "HttpClient.hpp"
+
+struct HttpRequest {
+    std::string URL;
+
+    // Must outlive the request
+    HttpHeaders const* Headers = nullptr;
+
+    std::string Body;
+
+    // Sends a HEAD request instead, without Body
+    bool HeadOnly = false;
+
+    // When set, the response body is handed here as it arrives instead of
+    // being collected, on the engine thread. Returning false aborts the
+    // transfer, which then completes with CURLE_WRITE_ERROR.
+    std::function<bool(std::string_view)> OnData;
+};
+
+// Runs many requests at once from one thread with curl_multi. Each host runs
+// at most MaxPerHost transfers, the rest wait in order until one finishes.
+// Handles and caches come from the HttpClient it was made with. Open
+// connections stay with the engine, and every transfer runs on its thread.
+class HttpEngine {
+public:
+    struct Options {
+        size_t MaxPerHost = 8;
+    };
+
+    // Runs on the engine thread, so it should hand off anything slow
+    using Callback = std::function<void(HttpResponse&)>;
+
+    HttpEngine(HttpClient& Client) : HttpEngine(Client, Options()) { }
+    HttpEngine(HttpClient& Client, Options Opts);
+
+    // Requests not yet finished complete with CURLE_ABORTED_BY_CALLBACK
+    ~HttpEngine();
+
+    HttpEngine(HttpEngine const&) = delete;
+    HttpEngine& operator=(HttpEngine const&) = delete;
+
+    void Submit(HttpRequest Request, Callback Done);
+    std::future<HttpResponse> Submit(HttpRequest Request);
+
+    // Opens Connections connections to URL's host with HEAD requests, so the
+    // first real requests find DNS, TCP and TLS already done. Waits for them.
+    void Prewarm(std::string const& URL, size_t Connections = 1);
+
+private:
+    struct Transfer {
+        HttpRequest Request;
+        Callback Done;
+        HttpResponse Response;
+        std::string Host;
+        CURL* Handle = nullptr;
+    };
+
+    struct Host {
+        size_t Active = 0;
+        std::deque<std::unique_ptr<Transfer>> Waiting;
+    };
+
+    HttpClient& Client;
+    const Options Opts;
+    CURLM* Multi = nullptr;
+
+    std::mutex Mutex;
+    std::deque<std::unique_ptr<Transfer>> Submitted;
+    bool Stopping = false;
+
+    // Engine thread only
+    std::map<std::string, Host> Hosts;
+    std::unordered_map<CURL*, std::unique_ptr<Transfer>> Running;
+
+    std::thread Loop;
+
+    void Run();
+    void StartReady();
+    void Start(std::unique_ptr<Transfer> Item);
+    void Finish(CURL* Handle, CURLcode Result);
+    void Abort();
+};
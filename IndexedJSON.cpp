@@ -0,0 +1,520 @@
+#include "IndexedJSON.hpp"
+
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define INDEXED_JSON_X86 1
+#endif
+
+namespace {
+
+// Bit i of each mask describes byte i of a 64 byte block
+struct BlockMasks {
+    uint64_t Quote;
+    uint64_t Backslash;
+    uint64_t Structural;
+};
+
+enum CharClass : uint8_t { Other, QuoteChar, BackslashChar, StructuralChar };
+
+constexpr std::array<uint8_t, 256> MakeClassTable() {
+    std::array<uint8_t, 256> Table { };
+    Table['"'] = QuoteChar;
+    Table['\\'] = BackslashChar;
+    for (char C : { '{', '}', '[', ']', ':', ',' }) Table[static_cast<uint8_t>(C)] = StructuralChar;
+    return Table;
+}
+
+constexpr std::array<uint8_t, 256> ClassTable = MakeClassTable();
+
+inline BlockMasks ClassifyScalar(const uint8_t* Block) {
+    BlockMasks Res { };
+    for (int i = 0; i < 64; ++i) {
+        uint64_t Bit = uint64_t(1) << i;
+        switch (ClassTable[Block[i]]) {
+        case QuoteChar: Res.Quote |= Bit; break;
+        case BackslashChar: Res.Backslash |= Bit; break;
+        case StructuralChar: Res.Structural |= Bit; break;
+        default: break;
+        }
+    }
+    return Res;
+}
+
+#ifdef INDEXED_JSON_X86
+
+// Setting bit 5 folds '[' onto '{' and ']' onto '}', so four compares find all six structurals
+__attribute__((target("sse2")))
+inline BlockMasks ClassifySSE2(const uint8_t* Block) {
+    const __m128i Quote = _mm_set1_epi8('"');
+    const __m128i Backslash = _mm_set1_epi8('\\');
+    const __m128i Case = _mm_set1_epi8(0x20);
+    const __m128i Open = _mm_set1_epi8('{');
+    const __m128i Close = _mm_set1_epi8('}');
+    const __m128i Colon = _mm_set1_epi8(':');
+    const __m128i Comma = _mm_set1_epi8(',');
+
+    BlockMasks Res { };
+    for (int i = 0; i < 4; ++i) {
+        __m128i In = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Block + i * 16));
+        __m128i Folded = _mm_or_si128(In, Case);
+        __m128i Structural = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(Folded, Open), _mm_cmpeq_epi8(Folded, Close)),
+            _mm_or_si128(_mm_cmpeq_epi8(In, Colon), _mm_cmpeq_epi8(In, Comma)));
+        Res.Quote |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(In, Quote)))) << (i * 16);
+        Res.Backslash |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(In, Backslash)))) << (i * 16);
+        Res.Structural |= uint64_t(uint16_t(_mm_movemask_epi8(Structural))) << (i * 16);
+    }
+    return Res;
+}
+
+__attribute__((target("avx2")))
+inline BlockMasks ClassifyAVX2(const uint8_t* Block) {
+    const __m256i Quote = _mm256_set1_epi8('"');
+    const __m256i Backslash = _mm256_set1_epi8('\\');
+    const __m256i Case = _mm256_set1_epi8(0x20);
+    const __m256i Open = _mm256_set1_epi8('{');
+    const __m256i Close = _mm256_set1_epi8('}');
+    const __m256i Colon = _mm256_set1_epi8(':');
+    const __m256i Comma = _mm256_set1_epi8(',');
+
+    BlockMasks Res { };
+    for (int i = 0; i < 2; ++i) {
+        __m256i In = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Block + i * 32));
+        __m256i Folded = _mm256_or_si256(In, Case);
+        __m256i Structural = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(Folded, Open), _mm256_cmpeq_epi8(Folded, Close)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(In, Colon), _mm256_cmpeq_epi8(In, Comma)));
+        Res.Quote |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(In, Quote)))) << (i * 32);
+        Res.Backslash |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(In, Backslash)))) << (i * 32);
+        Res.Structural |= uint64_t(uint32_t(_mm256_movemask_epi8(Structural))) << (i * 32);
+    }
+    return Res;
+}
+
+__attribute__((target("pclmul")))
+inline uint64_t PrefixXorCLMUL(uint64_t Bits) {
+    __m128i Product = _mm_clmulepi64_si128(_mm_set_epi64x(0, static_cast<int64_t>(Bits)), _mm_set1_epi8(char(0xFF)), 0);
+    return static_cast<uint64_t>(_mm_cvtsi128_si64(Product));
+}
+
+#endif
+
+// Bit i of the result is the xor of bits 0..i
+inline uint64_t PrefixXor(uint64_t Bits) {
+    Bits ^= Bits << 1;
+    Bits ^= Bits << 2;
+    Bits ^= Bits << 4;
+    Bits ^= Bits << 8;
+    Bits ^= Bits << 16;
+    Bits ^= Bits << 32;
+    return Bits;
+}
+
+// Characters preceded by an odd run of backslashes. PrevEscaped carries a
+// run that ends on the last byte of the previous block.
+inline uint64_t FindEscaped(uint64_t Backslash, uint64_t& PrevEscaped) {
+    if (Backslash == 0) {
+        uint64_t Res = PrevEscaped;
+        PrevEscaped = 0;
+        return Res;
+    }
+    const uint64_t EvenBits = 0x5555555555555555ull;
+    Backslash &= ~PrevEscaped;
+    uint64_t FollowsEscape = Backslash << 1 | PrevEscaped;
+    uint64_t OddStarts = Backslash & ~EvenBits & ~FollowsEscape;
+    uint64_t EvenSequences;
+    PrevEscaped = __builtin_add_overflow(OddStarts, Backslash, &EvenSequences);
+    uint64_t Invert = EvenSequences << 1;
+    return (EvenBits ^ Invert) & FollowsEscape;
+}
+
+// Stage one: offsets of every structural character outside strings and
+// every unescaped quote. Returns false if a string is left open.
+template<BlockMasks (*Classify)(const uint8_t*), uint64_t (*Xor)(uint64_t)>
+__attribute__((always_inline)) inline bool FindStructurals(std::string_view Text, std::vector<uint32_t>& Out) {
+    const uint8_t* Data = reinterpret_cast<const uint8_t*>(Text.data());
+    size_t Size = Text.size();
+    uint64_t PrevEscaped = 0;
+    uint64_t PrevInString = 0;
+
+    for (size_t Base = 0; Base < Size; Base += 64) {
+        const uint8_t* Block = Data + Base;
+        uint8_t Tail[64];
+        if (Size - Base < 64) {
+            memset(Tail, ' ', sizeof(Tail));
+            memcpy(Tail, Block, Size - Base);
+            Block = Tail;
+        }
+
+        BlockMasks Masks = Classify(Block);
+        uint64_t Quotes = Masks.Quote & ~FindEscaped(Masks.Backslash, PrevEscaped);
+        uint64_t InString = Xor(Quotes) ^ PrevInString;
+        PrevInString = static_cast<uint64_t>(static_cast<int64_t>(InString) >> 63);
+
+        uint64_t Tokens = (Masks.Structural & ~InString) | Quotes;
+        size_t Count = __builtin_popcountll(Tokens);
+        size_t First = Out.size();
+        Out.resize(First + Count);
+        uint32_t* Dest = Out.data() + First;
+        while (Tokens) {
+            *Dest++ = static_cast<uint32_t>(Base + __builtin_ctzll(Tokens));
+            Tokens &= Tokens - 1;
+        }
+    }
+
+    return PrevInString == 0;
+}
+
+// Each backend is compiled for its own target so the classifier inlines into the loop
+bool FindStructuralsScalar(std::string_view Text, std::vector<uint32_t>& Out) {
+    return FindStructurals<ClassifyScalar, PrefixXor>(Text, Out);
+}
+
+#ifdef INDEXED_JSON_X86
+__attribute__((target("sse2")))
+bool FindStructuralsSSE2(std::string_view Text, std::vector<uint32_t>& Out) {
+    return FindStructurals<ClassifySSE2, PrefixXor>(Text, Out);
+}
+
+__attribute__((target("avx2,pclmul")))
+bool FindStructuralsAVX2(std::string_view Text, std::vector<uint32_t>& Out) {
+    return FindStructurals<ClassifyAVX2, PrefixXorCLMUL>(Text, Out);
+}
+#endif
+
+using StructuralFinder = bool (*)(std::string_view, std::vector<uint32_t>&);
+
+struct Dispatch {
+    StructuralFinder Find;
+    const char* Name;
+};
+
+Dispatch SelectBackend() {
+#ifdef INDEXED_JSON_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("pclmul")) {
+        return { FindStructuralsAVX2, "avx2" };
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return { FindStructuralsSSE2, "sse2" };
+    }
+#endif
+    return { FindStructuralsScalar, "scalar" };
+}
+
+const Dispatch& Backend() {
+    static const Dispatch Selected = SelectBackend();
+    return Selected;
+}
+
+bool IsSpace(char C) {
+    return C == ' ' || C == '\n' || C == '\r' || C == '\t';
+}
+
+void AppendUTF8(std::string& Out, uint32_t Code) {
+    if (Code < 0x80) {
+        Out += static_cast<char>(Code);
+    } else if (Code < 0x800) {
+        Out += static_cast<char>(0xC0 | (Code >> 6));
+        Out += static_cast<char>(0x80 | (Code & 0x3F));
+    } else if (Code < 0x10000) {
+        Out += static_cast<char>(0xE0 | (Code >> 12));
+        Out += static_cast<char>(0x80 | ((Code >> 6) & 0x3F));
+        Out += static_cast<char>(0x80 | (Code & 0x3F));
+    } else {
+        Out += static_cast<char>(0xF0 | (Code >> 18));
+        Out += static_cast<char>(0x80 | ((Code >> 12) & 0x3F));
+        Out += static_cast<char>(0x80 | ((Code >> 6) & 0x3F));
+        Out += static_cast<char>(0x80 | (Code & 0x3F));
+    }
+}
+
+bool ParseHex4(std::string_view Raw, size_t At, uint32_t& Code) {
+    if (At + 4 > Raw.size()) return false;
+    Code = 0;
+    for (size_t i = At; i < At + 4; ++i) {
+        char C = Raw[i];
+        Code <<= 4;
+        if (C >= '0' && C <= '9') Code |= C - '0';
+        else if (C >= 'a' && C <= 'f') Code |= C - 'a' + 10;
+        else if (C >= 'A' && C <= 'F') Code |= C - 'A' + 10;
+        else return false;
+    }
+    return true;
+}
+
+// true, false, null, or a number as JSON writes them: -?(0|[1-9]\d*)(\.\d+)?([eE][+-]?\d+)?
+bool IsScalar(std::string_view Raw) {
+    if (Raw == "true" || Raw == "false" || Raw == "null") return true;
+
+    auto Digits = [&Raw](size_t& At) {
+        size_t Start = At;
+        while (At < Raw.size() && Raw[At] >= '0' && Raw[At] <= '9') ++At;
+        return At > Start;
+    };
+
+    size_t At = 0;
+    if (At < Raw.size() && Raw[At] == '-') ++At;
+    if (At < Raw.size() && Raw[At] == '0') {
+        ++At;
+    } else if (!Digits(At)) {
+        return false;
+    }
+    if (At < Raw.size() && Raw[At] == '.') {
+        ++At;
+        if (!Digits(At)) return false;
+    }
+    if (At < Raw.size() && (Raw[At] == 'e' || Raw[At] == 'E')) {
+        ++At;
+        if (At < Raw.size() && (Raw[At] == '+' || Raw[At] == '-')) ++At;
+        if (!Digits(At)) return false;
+    }
+    return At == Raw.size();
+}
+
+}
+
+const char* IndexedJSON::Backend() {
+    return ::Backend().Name;
+}
+
+void IndexedJSON::Clear() {
+    Text = { };
+    Positions.clear();
+    Match.clear();
+}
+
+bool IndexedJSON::Load(std::string_view NewText, std::string& Error) {
+    Clear();
+    if (NewText.size() >= Root) {
+        Error = "JSON text is too large to index";
+        return false;
+    }
+    Text = NewText;
+
+    Positions.reserve(Text.size() / 8);
+    if (!::Backend().Find(Text, Positions)) {
+        Error = "Unterminated string";
+        return false;
+    }
+    // Sentinel so looking one past the last token is always safe
+    Positions.push_back(static_cast<uint32_t>(Text.size()));
+
+    return Validate(Error);
+}
+
+// Stage two: walks the tokens once, checking the grammar, pairing brackets and
+// making sure everything between tokens is either whitespace or one valid scalar
+bool IndexedJSON::Validate(std::string& Error) {
+    size_t Count = Positions.size() - 1;
+    Match.assign(Count + 1, 0);
+
+    auto Fail = [&](std::string const& What, size_t Offset) {
+        Error = What + " at offset " + std::to_string(Offset);
+        return false;
+    };
+    auto CharAt = [&](size_t Token) {
+        return Token < Count ? Text[Positions[Token]] : '\0';
+    };
+    auto OnlySpace = [&](size_t Begin, size_t End) {
+        for (size_t i = Begin; i < End; ++i) {
+            if (!IsSpace(Text[i])) return false;
+        }
+        return true;
+    };
+
+    enum class Expect { Value, Key, Colon, Separator };
+
+    struct Open {
+        uint32_t Token;
+        char Close;
+    };
+    std::vector<Open> Stack;
+
+    Expect State = Expect::Value;
+    size_t Token = 0;
+    size_t Gap = 0;
+
+    while (true) {
+        size_t Pos = Token < Count ? Positions[Token] : Text.size();
+        char C = CharAt(Token);
+
+        if (State == Expect::Value) {
+            size_t Start = Gap;
+            while (Start < Pos && IsSpace(Text[Start])) ++Start;
+
+            if (Start < Pos) {
+                // Scalar, which runs up to the next token
+                size_t End = Pos;
+                while (End > Start && IsSpace(Text[End - 1])) --End;
+                for (size_t i = Start; i < End; ++i) {
+                    if (IsSpace(Text[i])) return Fail("Unexpected whitespace in value", i);
+                }
+                if (!IsScalar(Text.substr(Start, End - Start))) return Fail("Invalid value", Start);
+                State = Expect::Separator;
+                Gap = Pos;
+                continue;
+            }
+
+            if (C == '{' || C == '[') {
+                Stack.push_back({ static_cast<uint32_t>(Token), C == '{' ? '}' : ']' });
+                Gap = Pos + 1;
+                ++Token;
+                if (C == '{') {
+                    State = Expect::Key;
+                } else {
+                    // Empty array
+                    size_t Next = Token < Count ? Positions[Token] : Text.size();
+                    if (CharAt(Token) == ']' && OnlySpace(Gap, Next)) {
+                        Match[Stack.back().Token] = static_cast<uint32_t>(Token);
+                        Stack.pop_back();
+                        Gap = Next + 1;
+                        ++Token;
+                        State = Expect::Separator;
+                    }
+                }
+                continue;
+            }
+            if (C == '"') {
+                if (Token + 1 >= Count) return Fail("Unterminated string", Pos);
+                Gap = Positions[Token + 1] + 1;
+                Token += 2;
+                State = Expect::Separator;
+                continue;
+            }
+            return Fail("Expected a value", Pos);
+        }
+
+        if (!OnlySpace(Gap, Pos)) return Fail("Unexpected character", Gap);
+
+        if (State == Expect::Key) {
+            if (C == '}' && Token == Stack.back().Token + 1) {
+                Match[Stack.back().Token] = static_cast<uint32_t>(Token);
+                Stack.pop_back();
+                Gap = Pos + 1;
+                ++Token;
+                State = Expect::Separator;
+                continue;
+            }
+            if (C != '"' || Token + 1 >= Count) return Fail("Expected a key", Pos);
+            Gap = Positions[Token + 1] + 1;
+            Token += 2;
+            State = Expect::Colon;
+            continue;
+        }
+
+        if (State == Expect::Colon) {
+            if (C != ':') return Fail("Expected ':'", Pos);
+            Gap = Pos + 1;
+            ++Token;
+            State = Expect::Value;
+            continue;
+        }
+
+        // Separator, after a complete value
+        if (Stack.empty()) {
+            if (Token != Count) return Fail("Trailing characters", Pos);
+            return true;
+        }
+        if (Token == Count) return Fail("Unexpected end of input", Pos);
+        if (C == ',') {
+            Gap = Pos + 1;
+            ++Token;
+            State = Stack.back().Close == '}' ? Expect::Key : Expect::Value;
+            continue;
+        }
+        if (C != Stack.back().Close) return Fail("Mismatched bracket", Pos);
+        Match[Stack.back().Token] = static_cast<uint32_t>(Token);
+        Stack.pop_back();
+        Gap = Pos + 1;
+        ++Token;
+    }
+}
+
+IndexedJSON::Kind IndexedJSON::KindOf(uint32_t Prev) const {
+    switch (Text[ValueStart(Prev)]) {
+    case '{': return Kind::Object;
+    case '[': return Kind::Array;
+    case '"': return Kind::String;
+    case 't': return Kind::True;
+    case 'f': return Kind::False;
+    case 'n': return Kind::Null;
+    default: return Kind::Number;
+    }
+}
+
+uint32_t IndexedJSON::After(uint32_t Prev) const {
+    uint32_t Next = Prev + 1;
+    switch (Text[ValueStart(Prev)]) {
+    case '{':
+    case '[':
+        return Match[Next] + 1;
+    case '"':
+        return Next + 2;
+    default:
+        return Next;
+    }
+}
+
+std::string_view IndexedJSON::Scalar(uint32_t Prev) const {
+    size_t Start = ValueStart(Prev);
+    size_t End = Positions[Prev + 1];
+    while (End > Start && IsSpace(Text[End - 1])) --End;
+    return Text.substr(Start, End - Start);
+}
+
+bool IndexedJSON::Unescape(std::string_view Raw, std::string& Out) {
+    size_t Escape = Raw.find('\\');
+    if (Escape == std::string_view::npos) {
+        Out.assign(Raw);
+        return true;
+    }
+
+    Out.assign(Raw.substr(0, Escape));
+    size_t i = Escape;
+    while (i < Raw.size()) {
+        char C = Raw[i];
+        if (C != '\\') {
+            size_t Next = Raw.find('\\', i);
+            if (Next == std::string_view::npos) Next = Raw.size();
+            Out.append(Raw.substr(i, Next - i));
+            i = Next;
+            continue;
+        }
+        if (i + 1 >= Raw.size()) return false;
+        switch (Raw[i + 1]) {
+        case '"': Out += '"'; break;
+        case '\\': Out += '\\'; break;
+        case '/': Out += '/'; break;
+        case 'b': Out += '\b'; break;
+        case 'f': Out += '\f'; break;
+        case 'n': Out += '\n'; break;
+        case 'r': Out += '\r'; break;
+        case 't': Out += '\t'; break;
+        case 'u': {
+            uint32_t Code;
+            if (!ParseHex4(Raw, i + 2, Code)) return false;
+            i += 4;
+            if (Code >= 0xD800 && Code < 0xDC00) {
+                // Surrogate pair, the low half a second \uXXXX ending at i + 7
+                uint32_t Low;
+                if (i + 7 >= Raw.size() || Raw[i + 2] != '\\' || Raw[i + 3] != 'u') return false;
+                if (!ParseHex4(Raw, i + 4, Low) || Low < 0xDC00 || Low >= 0xE000) return false;
+                Code = 0x10000 + ((Code - 0xD800) << 10) + (Low - 0xDC00);
+                i += 6;
+            } else if (Code >= 0xDC00 && Code < 0xE000) {
+                return false;
+            }
+            AppendUTF8(Out, Code);
+            break;
+        }
+        default:
+            return false;
+        }
+        i += 2;
+    }
+    return true;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// JSON document that is never parsed into a tree. Loading finds every
+// structural character and string quote in one vectorized pass (AVX2 or
+// SSE2 when the CPU has them, scalar otherwise), then checks the token
+// sequence and pairs up brackets. Values are located and decoded on demand
+// from the original text.
+//
+// Values are addressed by the token that precedes them: the ':' of an
+// object member, the '[' or ',' before an array element, or Root for the
+// top-level value.
+class IndexedJSON {
+public:
+    static constexpr uint32_t Root = UINT32_MAX;
+
+    enum class Kind { Object, Array, String, Number, True, False, Null };
+
+    // Builds the index over Text, which must outlive this object. Returns
+    // false with Error set if Text is not well-formed.
+    bool Load(std::string_view Text, std::string& Error);
+
+    // Frees the index but keeps its capacity
+    void Clear();
+
+    size_t Capacity() const { return Positions.capacity() * 2 * sizeof(uint32_t); }
+
+    std::string_view GetText() const { return Text; }
+
+    Kind KindOf(uint32_t Prev) const;
+
+    // Token of the opening bracket of the container value after Prev
+    uint32_t ContainerToken(uint32_t Prev) const { return Prev + 1; }
+
+    // Calls Func(RawKey, Prev) for each member of the object opened at token
+    // Open, where RawKey still has its escapes and Prev addresses the value
+    template<typename FuncT>
+    void ForEachMember(uint32_t Open, FuncT&& Func) const {
+        if (IsEmpty(Open)) return;
+        uint32_t Key = Open + 1;
+        while (true) {
+            uint32_t Colon = Key + 2;
+            Func(Text.substr(Positions[Key] + 1, Positions[Key + 1] - Positions[Key] - 1), Colon);
+            uint32_t Next = After(Colon);
+            if (Text[Positions[Next]] != ',') return;
+            Key = Next + 1;
+        }
+    }
+
+    // Calls Func(Prev) for each element of the array opened at token Open
+    template<typename FuncT>
+    void ForEachElement(uint32_t Open, FuncT&& Func) const {
+        if (IsEmpty(Open)) return;
+        uint32_t Prev = Open;
+        while (true) {
+            Func(Prev);
+            uint32_t Next = After(Prev);
+            if (Text[Positions[Next]] != ',') return;
+            Prev = Next;
+        }
+    }
+
+    // Contents of the string value after Prev, escapes intact
+    std::string_view RawString(uint32_t Prev) const {
+        return Text.substr(Positions[Prev + 1] + 1, Positions[Prev + 2] - Positions[Prev + 1] - 1);
+    }
+
+    // Text of the number, true, false or null value after Prev
+    std::string_view Scalar(uint32_t Prev) const;
+
+    // Replaces Out with Raw decoded, false if Raw has an invalid escape
+    static bool Unescape(std::string_view Raw, std::string& Out);
+
+    // Which stage one implementation this CPU uses
+    static const char* Backend();
+
+private:
+    std::string_view Text;
+
+    // Offsets of structural characters and unescaped quotes, in order
+    std::vector<uint32_t> Positions;
+
+    // For each opening bracket token, the token of its closing bracket
+    std::vector<uint32_t> Match;
+
+    size_t SkipSpace(size_t Offset) const {
+        while (Offset < Text.size() && (Text[Offset] == ' ' || Text[Offset] == '\n' || Text[Offset] == '\r' || Text[Offset] == '\t')) ++Offset;
+        return Offset;
+    }
+
+    size_t ValueStart(uint32_t Prev) const {
+        return SkipSpace(Prev == Root ? 0 : Positions[Prev] + 1);
+    }
+
+    bool IsEmpty(uint32_t Open) const {
+        return Match[Open] == Open + 1 && SkipSpace(Positions[Open] + 1) == Positions[Open + 1];
+    }
+
+    // Token that follows the value after Prev
+    uint32_t After(uint32_t Prev) const;
+
+    bool Validate(std::string& Error);
+};
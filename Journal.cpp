@@ -0,0 +1,353 @@
+#include "Journal.hpp"
+#include "Transfer.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <set>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr uint32_t RecordMagic = 0x4C4E524A;
+
+// Precedes every record, followed by the path and then the contents
+struct RecordHeader {
+    uint32_t Magic;
+    uint32_t PathSize;
+    uint64_t ContentSize;
+    uint64_t Checksum;
+};
+
+uint64_t RecordChecksum(uint32_t PathSize, uint64_t ContentSize, std::string_view Path, std::span<const uint8_t> Contents) {
+    uint64_t Hash = FNV1(reinterpret_cast<const uint8_t*>(&PathSize), sizeof(PathSize));
+    Hash = FNV1(reinterpret_cast<const uint8_t*>(&ContentSize), sizeof(ContentSize), Hash);
+    Hash = FNV1(reinterpret_cast<const uint8_t*>(Path.data()), Path.size(), Hash);
+    return FNV1(Contents.data(), Contents.size(), Hash);
+}
+
+bool WriteAll(int Fd, const uint8_t* Data, size_t Size) {
+    while (Size != 0) {
+        ssize_t Count = write(Fd, Data, Size);
+        if (Count < 0 && errno == EINTR) continue;
+        if (Count <= 0) return false;
+        Data += Count;
+        Size -= Count;
+    }
+    return true;
+}
+
+bool ReadAll(int Fd, uint64_t Offset, uint8_t* Data, size_t Size) {
+    while (Size != 0) {
+        ssize_t Count = pread(Fd, Data, Size, static_cast<off_t>(Offset));
+        if (Count < 0 && errno == EINTR) continue;
+        if (Count <= 0) return false;
+        Data += Count;
+        Offset += Count;
+        Size -= Count;
+    }
+    return true;
+}
+
+bool SyncDirectory(std::string const& Path) {
+    int Fd = open(Path.empty() ? "." : Path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (Fd < 0) return false;
+    bool Ok = fsync(Fd) == 0;
+    close(Fd);
+    return Ok;
+}
+
+// Durably replaces Path with Contents. The caller syncs the directory afterwards.
+bool ReplaceFile(std::string const& Path, std::span<const uint8_t> Contents) {
+    static std::atomic<uint64_t> TempCounter = 0;
+    std::string TempPath = Path + ".tmp." + std::to_string(getpid()) + ".j" + std::to_string(TempCounter++);
+
+    int Fd = open(TempPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (Fd < 0) return false;
+
+    bool Ok = WriteAll(Fd, Contents.data(), Contents.size()) && fdatasync(Fd) == 0;
+    Ok = (close(Fd) == 0) && Ok;
+
+    if (!Ok || rename(TempPath.c_str(), Path.c_str()) != 0) {
+        unlink(TempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+}
+
+struct Journal::Segment {
+    std::string Path;
+    int Fd = -1;
+
+    // Bytes of complete records
+    uint64_t Size = 0;
+
+    ~Segment() {
+        if (Fd >= 0) close(Fd);
+    }
+};
+
+Journal::Journal(std::string Directory, Options Opts)
+: Directory(std::move(Directory)), Opts(Opts) { }
+
+std::shared_ptr<Journal> Journal::Open(std::string const& Directory, Options Opts) {
+    if (mkdir(Directory.c_str(), 0777) != 0 && errno != EEXIST) {
+        return nullptr;
+    }
+
+    std::shared_ptr<Journal> Res(new Journal(Directory, Opts));
+    if (!Res->Recover()) return nullptr;
+
+    Res->Active = Res->CreateSegment();
+    if (!Res->Active || !Res->Checkpoint()) return nullptr;
+
+    Res->Flusher = std::thread(&Journal::FlushLoop, Res.get());
+    Res->Checkpointer = std::thread(&Journal::CheckpointLoop, Res.get());
+    return Res;
+}
+
+Journal::~Journal() {
+    {
+        std::lock_guard Lock(Mutex);
+        Stopping = true;
+    }
+    Wake.notify_all();
+    CheckpointWake.notify_all();
+    if (Flusher.joinable()) Flusher.join();
+    if (Checkpointer.joinable()) Checkpointer.join();
+
+    // Leaves nothing to recover after a clean shutdown
+    if (Active && Checkpoint() && Active->Size == 0) {
+        unlink(Active->Path.c_str());
+    }
+}
+
+std::shared_ptr<Journal::Segment> Journal::CreateSegment() {
+    std::shared_ptr<Segment> Res = std::make_shared<Segment>();
+    Res->Path = Directory + "/journal." + std::to_string(NextGeneration++) + ".wal";
+    Res->Fd = open(Res->Path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (Res->Fd < 0) return nullptr;
+
+    // The segment must survive a crash before anything is committed to it
+    if (!SyncDirectory(Directory)) return nullptr;
+    return Res;
+}
+
+// Indexes the records of every segment left behind, oldest generation first, so
+// the newest contents of each path win. A torn or corrupt record ends its segment.
+bool Journal::Recover() {
+    DIR* Dir = opendir(Directory.c_str());
+    if (!Dir) return false;
+
+    std::vector<std::pair<uint64_t, std::string>> Found;
+    while (dirent* Entry = readdir(Dir)) {
+        std::string_view Name = Entry->d_name;
+        if (!Name.starts_with("journal.") || !Name.ends_with(".wal")) continue;
+        std::string_view Number = Name.substr(8, Name.size() - 12);
+        uint64_t Generation;
+        auto [Ptr, Ec] = std::from_chars(Number.data(), Number.data() + Number.size(), Generation);
+        if (Ec != std::errc() || Ptr != Number.data() + Number.size()) continue;
+        Found.emplace_back(Generation, Directory + "/" + std::string(Name));
+    }
+    closedir(Dir);
+    std::sort(Found.begin(), Found.end());
+
+    std::vector<uint8_t> Record;
+    for (auto const& [Generation, Path] : Found) {
+        NextGeneration = std::max(NextGeneration, Generation + 1);
+
+        std::shared_ptr<Segment> Seg = std::make_shared<Segment>();
+        Seg->Path = Path;
+        Seg->Fd = open(Path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (Seg->Fd < 0) return false;
+        Sealed.push_back(Seg);
+
+        struct stat Info;
+        if (fstat(Seg->Fd, &Info) != 0) return false;
+        uint64_t FileSize = static_cast<uint64_t>(Info.st_size);
+
+        while (true) {
+            RecordHeader Header;
+            if (!ReadAll(Seg->Fd, Seg->Size, reinterpret_cast<uint8_t*>(&Header), sizeof(Header))) break;
+            if (Header.Magic != RecordMagic) break;
+            if (Header.ContentSize > FileSize || Seg->Size + sizeof(Header) + Header.PathSize + Header.ContentSize > FileSize) break;
+
+            Record.resize(Header.PathSize + Header.ContentSize);
+            if (!ReadAll(Seg->Fd, Seg->Size + sizeof(Header), Record.data(), Record.size())) break;
+
+            std::string_view RecordPath(reinterpret_cast<const char*>(Record.data()), Header.PathSize);
+            std::span<const uint8_t> Contents(Record.data() + Header.PathSize, Header.ContentSize);
+            if (RecordChecksum(Header.PathSize, Header.ContentSize, RecordPath, Contents) != Header.Checksum) break;
+
+            Latest.insert_or_assign(std::string(RecordPath), Location { Seg, Seg->Size + sizeof(Header) + Header.PathSize, Header.ContentSize });
+            Seg->Size += sizeof(Header) + Record.size();
+            ++Counters.Replayed;
+        }
+    }
+    return true;
+}
+
+bool Journal::Commit(std::string const& Path, std::span<const uint8_t> Contents) {
+    RecordHeader Header { RecordMagic, static_cast<uint32_t>(Path.size()), Contents.size(), 0 };
+    Header.Checksum = RecordChecksum(Header.PathSize, Header.ContentSize, Path, Contents);
+    const uint8_t* HeaderBytes = reinterpret_cast<const uint8_t*>(&Header);
+
+    std::unique_lock Lock(Mutex);
+    if (Failed || Stopping) return false;
+
+    size_t At = Batch.size();
+    Batch.insert(Batch.end(), HeaderBytes, HeaderBytes + sizeof(Header));
+    Batch.insert(Batch.end(), Path.begin(), Path.end());
+    Batch.insert(Batch.end(), Contents.begin(), Contents.end());
+    BatchRecords.push_back({ Path, At + sizeof(Header) + Path.size(), Contents.size() });
+
+    uint64_t Seq = ++LastSeq;
+    ++Counters.Commits;
+    Wake.notify_one();
+
+    Durable.wait(Lock, [&] { return DurableSeq >= Seq || Failed; });
+    return DurableSeq >= Seq;
+}
+
+void Journal::FlushLoop() {
+    std::vector<uint8_t> Writing;
+    std::vector<Pending> Records;
+
+    std::unique_lock Lock(Mutex);
+    while (true) {
+        Wake.wait(Lock, [&] { return !Batch.empty() || Stopping; });
+        if (Batch.empty()) return;
+
+        // Keep the batch open a little so concurrent commits share its sync
+        if (Opts.BatchWindow.count() > 0 && !Stopping) {
+            Wake.wait_for(Lock, Opts.BatchWindow, [&] { return Stopping; });
+        }
+
+        Writing.swap(Batch);
+        Records.swap(BatchRecords);
+        uint64_t Seq = LastSeq;
+        Lock.unlock();
+
+        {
+            std::lock_guard Writer(WriteMutex);
+            bool Ok = WriteAll(Active->Fd, Writing.data(), Writing.size()) && fdatasync(Active->Fd) == 0;
+
+            Lock.lock();
+            if (Ok) {
+                uint64_t Base = Active->Size;
+                Active->Size += Writing.size();
+                for (Pending& Record : Records) {
+                    Latest.insert_or_assign(std::move(Record.Path), Location { Active, Base + Record.Offset, Record.Length });
+                }
+                DurableSeq = Seq;
+                ++Counters.Batches;
+                if (Active->Size >= Opts.CheckpointBytes && !CheckpointWanted) {
+                    CheckpointWanted = true;
+                    CheckpointWake.notify_one();
+                }
+            } else {
+                Failed = true;
+            }
+        }
+
+        Writing.clear();
+        Records.clear();
+        Durable.notify_all();
+    }
+}
+
+void Journal::CheckpointLoop() {
+    std::unique_lock Lock(Mutex);
+    while (true) {
+        CheckpointWake.wait(Lock, [&] { return CheckpointWanted || Stopping; });
+        if (Stopping) return;
+
+        Lock.unlock();
+        Checkpoint();
+        Lock.lock();
+        CheckpointWanted = false;
+    }
+}
+
+bool Journal::Checkpoint() {
+    std::lock_guard Serial(CheckpointMutex);
+
+    std::vector<std::shared_ptr<Segment>> Folded;
+    {
+        // New commits go to a fresh segment while the old ones are folded
+        std::lock_guard Writer(WriteMutex);
+        std::lock_guard Lock(Mutex);
+        if (Active->Size != 0) {
+            std::shared_ptr<Segment> Next = CreateSegment();
+            if (!Next) return false;
+            Sealed.push_back(std::move(Active));
+            Active = std::move(Next);
+        }
+        Folding.swap(Latest);
+        Folded = Sealed;
+    }
+    if (Folding.empty() && Folded.empty()) return true;
+
+    bool Ok = true;
+    std::vector<uint8_t> Contents;
+    std::set<std::string> Directories;
+    for (auto const& [Path, Where] : Folding) {
+        Contents.resize(Where.Length);
+        if (!ReadAll(Where.File->Fd, Where.Offset, Contents.data(), Contents.size()) || !ReplaceFile(Path, Contents)) {
+            Ok = false;
+            continue;
+        }
+        Directories.insert(std::filesystem::path(Path).parent_path().string());
+    }
+    for (std::string const& Dir : Directories) {
+        Ok = SyncDirectory(Dir) && Ok;
+    }
+
+    std::lock_guard Lock(Mutex);
+    if (!Ok) {
+        // Everything stays logged, anything committed since takes precedence
+        for (auto& [Path, Where] : Folding) {
+            Latest.try_emplace(Path, std::move(Where));
+        }
+        Folding.clear();
+        return false;
+    }
+    Folding.clear();
+
+    for (std::shared_ptr<Segment> const& Seg : Folded) {
+        unlink(Seg->Path.c_str());
+    }
+    Sealed.erase(Sealed.begin(), Sealed.begin() + Folded.size());
+    ++Counters.Checkpoints;
+    return true;
+}
+
+bool Journal::Read(std::string const& Path, std::vector<uint8_t>& Out) const {
+    Location Where;
+    {
+        std::lock_guard Lock(Mutex);
+        auto Found = Latest.find(Path);
+        if (Found == Latest.end()) {
+            Found = Folding.find(Path);
+            if (Found == Folding.end()) return false;
+        }
+        Where = Found->second;
+    }
+
+    // The segment stays open while Where holds it, even once a checkpoint deletes it
+    Out.resize(Where.Length);
+    return ReadAll(Where.File->Fd, Where.Offset, Out.data(), Out.size());
+}
+
+Journal::Stats Journal::GetStats() const {
+    std::lock_guard Lock(Mutex);
+    return Counters;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Write-ahead log shared by many files. Commit appends the new contents of a
+// file to the active log segment and returns once it is durable. Commits that
+// arrive within BatchWindow of each other share one write and one fdatasync,
+// so durable throughput grows with the batch rather than the number of files.
+//
+// A background checkpoint starts a new segment, writes the latest contents of
+// each file logged in the old ones to the file itself, and deletes them.
+// Opening a journal replays and checkpoints any segments a crash left behind.
+class Journal {
+public:
+    struct Options {
+        // How long a batch stays open for more commits before it is synced
+        std::chrono::microseconds BatchWindow = std::chrono::microseconds(500);
+
+        // Size of the active segment that triggers a checkpoint
+        uint64_t CheckpointBytes = 64 * 1024 * 1024;
+    };
+
+    struct Stats {
+        uint64_t Commits = 0;
+        uint64_t Batches = 0;
+        uint64_t Checkpoints = 0;
+        uint64_t Replayed = 0;
+    };
+
+    // Opens the journal kept in Directory, creating it if needed, and recovers
+    // what a previous run left there. Null if the directory cannot be used or
+    // recovery failed to write a file.
+    static std::shared_ptr<Journal> Open(std::string const& Directory, Options Opts);
+    static std::shared_ptr<Journal> Open(std::string const& Directory) { return Open(Directory, Options()); }
+
+    // Stops the background threads and checkpoints everything
+    ~Journal();
+
+    Journal(Journal const&) = delete;
+    Journal& operator=(Journal const&) = delete;
+
+    // Logs Contents as the new state of Path, blocking until it is durable.
+    // False if the log could not be written, after which the journal refuses
+    // all further commits.
+    bool Commit(std::string const& Path, std::span<const uint8_t> Contents);
+
+    // Folds everything logged so far into the files themselves
+    bool Checkpoint();
+
+    // The latest committed contents of Path while the log still holds them,
+    // which are newer than the file itself. False once a checkpoint has
+    // written them to Path, or if they could not be read.
+    bool Read(std::string const& Path, std::vector<uint8_t>& Out) const;
+
+    Stats GetStats() const;
+
+private:
+    struct Segment;
+
+    // Where the latest contents of a path sit in the log
+    struct Location {
+        std::shared_ptr<Segment> File;
+        uint64_t Offset;
+        uint64_t Length;
+    };
+
+    // A record appended to the open batch
+    struct Pending {
+        std::string Path;
+        uint64_t Offset;
+        uint64_t Length;
+    };
+
+    const std::string Directory;
+    const Options Opts;
+
+    // Guards the batch, segment and index state that follows
+    mutable std::mutex Mutex;
+    std::condition_variable Wake;
+    std::condition_variable Durable;
+    std::condition_variable CheckpointWake;
+
+    std::vector<uint8_t> Batch;
+    std::vector<Pending> BatchRecords;
+    uint64_t LastSeq = 0;
+    uint64_t DurableSeq = 0;
+    bool Failed = false;
+    bool Stopping = false;
+    bool CheckpointWanted = false;
+
+    std::shared_ptr<Segment> Active;
+
+    // Older segments, deleted once a checkpoint has folded them
+    std::vector<std::shared_ptr<Segment>> Sealed;
+
+    std::unordered_map<std::string, Location> Latest;
+
+    // Taken out of Latest by the running checkpoint until it has written them
+    std::unordered_map<std::string, Location> Folding;
+    uint64_t NextGeneration = 0;
+    Stats Counters;
+
+    // Held while a batch is written so segments are never swapped under it
+    std::mutex WriteMutex;
+
+    // Serializes checkpoints
+    std::mutex CheckpointMutex;
+
+    std::thread Flusher;
+    std::thread Checkpointer;
+
+    Journal(std::string Directory, Options Opts);
+
+    bool Recover();
+    std::shared_ptr<Segment> CreateSegment();
+    void FlushLoop();
+    void CheckpointLoop();
+};
@@ -0,0 +1,376 @@
+#include "ObjectStore.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// Shared for saves and loads, exclusive for Collect, so a collection never
+// deletes chunks of a snapshot that is still being written
+class StoreLock {
+public:
+    StoreLock(std::string const& Directory, int Mode) {
+        Fd = open((Directory + "/lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (Fd >= 0) {
+            while (flock(Fd, Mode) != 0 && errno == EINTR) { }
+        }
+    }
+
+    ~StoreLock() {
+        if (Fd >= 0) close(Fd);
+    }
+
+private:
+    int Fd;
+};
+
+std::string HexHash(std::array<uint8_t, 32> const& Hash) {
+    static const char Digits[] = "0123456789abcdef";
+    std::string Res(64, '0');
+    for (size_t i = 0; i < Hash.size(); ++i) {
+        Res[i * 2] = Digits[Hash[i] >> 4];
+        Res[i * 2 + 1] = Digits[Hash[i] & 0xF];
+    }
+    return Res;
+}
+
+bool IsHash(std::string const& Hash) {
+    return Hash.size() == 64 && Hash.find_first_not_of("0123456789abcdef") == std::string::npos;
+}
+
+bool ValidRefName(std::string const& Name) {
+    return !Name.empty() && Name[0] != '.' && Name.find('/') == std::string::npos;
+}
+
+bool WriteReplace(std::string const& Path, std::string const& TempPath, const void* Data, size_t Size) {
+    int Fd = open(TempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (Fd < 0) return false;
+
+    const uint8_t* Pos = static_cast<const uint8_t*>(Data);
+    bool Ok = true;
+    while (Size != 0) {
+        ssize_t Count = write(Fd, Pos, Size);
+        if (Count < 0 && errno == EINTR) continue;
+        if (Count <= 0) {
+            Ok = false;
+            break;
+        }
+        Pos += Count;
+        Size -= Count;
+    }
+    Ok = (close(Fd) == 0) && Ok;
+
+    if (!Ok || rename(TempPath.c_str(), Path.c_str()) != 0) {
+        unlink(TempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool ReadWhole(std::string const& Path, std::vector<uint8_t>& Out) {
+    std::shared_ptr<FileHandle> File = FileHandle::Open(Path);
+    if (!File) return false;
+    Out.resize(File->Size());
+    return File->ReadAt(0, Out);
+}
+
+std::string TempSuffix() {
+    static std::atomic<uint64_t> Counter = 0;
+    return std::to_string(getpid()) + "." + std::to_string(Counter++);
+}
+
+}
+
+void StoreSerializer::PushBytes(std::string const& Name, std::span<const uint8_t> Bytes, size_t Alignment) {
+    std::optional<std::string> Hash = Store.Put(Bytes);
+    if (!Hash) Failed = true;
+    AtChecked("$blob") = Hash.value_or("");
+    if (Alignment > 1) AtChecked("$align") = Alignment;
+}
+
+void StoreSerializer::PushFileRange(std::string const& Name, std::shared_ptr<FileHandle> const& File, uint64_t Offset, uint64_t Length) {
+    std::vector<uint8_t> Bytes(Length);
+    if (Length != 0 && (!File || !File->ReadAt(Offset, Bytes))) {
+        throw StreamTransferError { "File range could not be read for storing:\n" + DumpScopes() };
+    }
+    PushBytes(Name, Bytes);
+}
+
+void StoreSerializer::EndScope() {
+    Frame Top = std::move(Frames.back());
+    Frames.pop_back();
+
+    nlohmann::json Value = Seal(Top, false);
+    Frames.back().Order.push_back(Top.Name);
+    Frames.back().Data[Top.Name] = std::move(Value);
+}
+
+std::optional<std::string> StoreSerializer::Finish() {
+    if (Frames.size() != 1) {
+        throw StreamTransferError { "Snapshot finished with open scopes:\n" + DumpScopes() };
+    }
+    nlohmann::json Root = Seal(Frames.back(), true);
+    if (Failed) return std::nullopt;
+    return Root["$ref"].get<std::string>();
+}
+
+nlohmann::json StoreSerializer::Seal(Frame& Top, bool Root) {
+    auto StoreText = [this](std::string const& Text) {
+        std::optional<std::string> Hash = Store.Put(std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(Text.data()), Text.size()));
+        if (!Hash) Failed = true;
+        return Hash.value_or("");
+    };
+
+    nlohmann::json Res = std::move(Top.Data);
+
+    // Groups follow push order, so Vector elements group by index
+    size_t GroupSize = Store.Opts.GroupSize;
+    if (GroupSize != 0 && Top.Order.size() > GroupSize) {
+        nlohmann::json Groups = nlohmann::json::array();
+        for (size_t Begin = 0; Begin < Top.Order.size(); Begin += GroupSize) {
+            nlohmann::json Group = nlohmann::json::object();
+            for (size_t i = Begin; i < std::min(Begin + GroupSize, Top.Order.size()); ++i) {
+                Group[Top.Order[i]] = std::move(Res[Top.Order[i]]);
+            }
+            Groups.push_back(StoreText(Group.dump()));
+        }
+        Res = nlohmann::json { { "$groups", std::move(Groups) } };
+    }
+
+    if (!Root && !Res.is_object()) return Res;
+
+    std::string Text = Res.dump();
+    if (!Root && Text.size() < Store.Opts.ChunkThreshold) return Res;
+    return nlohmann::json { { "$ref", StoreText(Text) } };
+}
+
+ObjectStore::ObjectStore(std::string Directory, Options Opts)
+: Directory(std::move(Directory)), Opts(Opts) { }
+
+std::shared_ptr<ObjectStore> ObjectStore::Open(std::string const& Directory, Options Opts) {
+    std::error_code Error;
+    std::filesystem::create_directories(Directory + "/objects", Error);
+    std::filesystem::create_directories(Directory + "/refs", Error);
+    if (!std::filesystem::is_directory(Directory + "/objects") || !std::filesystem::is_directory(Directory + "/refs")) {
+        return nullptr;
+    }
+    return std::shared_ptr<ObjectStore>(new ObjectStore(Directory, Opts));
+}
+
+std::string ObjectStore::ObjectPath(std::string const& Hash) const {
+    return Directory + "/objects/" + Hash.substr(0, 2) + "/" + Hash.substr(2);
+}
+
+std::optional<std::string> ObjectStore::Put(std::span<const uint8_t> Bytes) {
+    std::string Hash = HexHash(SHA256(Bytes.data(), Bytes.size()));
+    std::string Path = ObjectPath(Hash);
+
+    struct stat Info;
+    if (stat(Path.c_str(), &Info) == 0) {
+        ++Deduplicated;
+        return Hash;
+    }
+
+    std::string Fanout = Directory + "/objects/" + Hash.substr(0, 2);
+    if (mkdir(Fanout.c_str(), 0777) != 0 && errno != EEXIST) return std::nullopt;
+    if (!WriteReplace(Path, Fanout + "/.tmp." + TempSuffix(), Bytes.data(), Bytes.size())) return std::nullopt;
+
+    ++Written;
+    return Hash;
+}
+
+bool ObjectStore::Get(std::string const& Hash, std::vector<uint8_t>& Out) const {
+    return IsHash(Hash) && ReadWhole(ObjectPath(Hash), Out);
+}
+
+bool ObjectStore::Contains(std::string const& Hash) const {
+    struct stat Info;
+    return IsHash(Hash) && stat(ObjectPath(Hash).c_str(), &Info) == 0;
+}
+
+bool ObjectStore::SetRef(std::string const& Name, std::string const& Hash) {
+    if (!ValidRefName(Name) || !IsHash(Hash)) return false;
+    std::string Path = Directory + "/refs/" + Name;
+    return WriteReplace(Path, Directory + "/refs/.tmp." + TempSuffix(), Hash.data(), Hash.size());
+}
+
+std::optional<std::string> ObjectStore::GetRef(std::string const& Name) const {
+    std::vector<uint8_t> Contents;
+    if (!ValidRefName(Name) || !ReadWhole(Directory + "/refs/" + Name, Contents)) return std::nullopt;
+    std::string Hash(Contents.begin(), Contents.end());
+    if (!IsHash(Hash)) return std::nullopt;
+    return Hash;
+}
+
+bool ObjectStore::DeleteRef(std::string const& Name) {
+    return ValidRefName(Name) && unlink((Directory + "/refs/" + Name).c_str()) == 0;
+}
+
+std::vector<std::string> ObjectStore::ListRefs() const {
+    std::vector<std::string> Res;
+    std::error_code Error;
+    for (auto const& Entry : std::filesystem::directory_iterator(Directory + "/refs", Error)) {
+        std::string Name = Entry.path().filename().string();
+        if (ValidRefName(Name)) Res.push_back(Name);
+    }
+    std::sort(Res.begin(), Res.end());
+    return Res;
+}
+
+std::optional<std::string> ObjectStore::SaveCb(std::function<void(StoreSerializer&)> const& Func, std::string const& Ref) {
+    StoreLock Lock(Directory, LOCK_SH);
+    StoreSerializer Ser(*this);
+    Func(Ser);
+
+    std::optional<std::string> Hash = Ser.Finish();
+    if (Hash && !Ref.empty() && !SetRef(Ref, *Hash)) return std::nullopt;
+    return Hash;
+}
+
+// Replaces chunk references under Node with their contents, and blobs with
+// byte ranges in Deser's binary section
+static bool Resolve(ObjectStore const& Store, nlohmann::json& Node, JSONDeserializer& Deser, std::vector<uint8_t>& Scratch) {
+    if (!Node.is_object()) return true;
+
+    auto Parse = [&Scratch](std::string const& Hash) {
+        try {
+            return nlohmann::json::parse(Scratch.begin(), Scratch.end());
+        } catch (nlohmann::json::parse_error const&) {
+            throw StreamTransferError { "Stored chunk " + Hash + " is corrupt\n" };
+        }
+    };
+
+    auto Ref = Node.find("$ref");
+    if (Ref != Node.end()) {
+        std::string Hash = Ref->get<std::string>();
+        if (!Store.Get(Hash, Scratch)) return false;
+        Node = Parse(Hash);
+        return Resolve(Store, Node, Deser, Scratch);
+    }
+
+    auto Groups = Node.find("$groups");
+    if (Groups != Node.end()) {
+        nlohmann::json Merged = nlohmann::json::object();
+        for (nlohmann::json const& Group : *Groups) {
+            std::string Hash = Group.get<std::string>();
+            if (!Store.Get(Hash, Scratch)) return false;
+            nlohmann::json Members = Parse(Hash);
+            for (auto& [Key, Value] : Members.items()) {
+                Merged[Key] = std::move(Value);
+            }
+        }
+        Node = std::move(Merged);
+    }
+
+    auto Blob = Node.find("$blob");
+    if (Blob != Node.end()) {
+        std::string Hash = Blob->get<std::string>();
+        size_t Alignment = Node.value("$align", size_t(1));
+        if (!Store.Get(Hash, Scratch)) return false;
+
+        std::vector<uint8_t>& Binary = Deser.Binary;
+        Binary.resize(AlignUp(Binary.size(), Alignment), 0);
+        Node["Begin"] = Binary.size();
+        Binary.insert(Binary.end(), Scratch.begin(), Scratch.end());
+        Node["End"] = Binary.size();
+        Node.erase("$blob");
+        Node.erase("$align");
+    }
+
+    for (auto& [Key, Child] : Node.items()) {
+        if (!Resolve(Store, Child, Deser, Scratch)) return false;
+    }
+    return true;
+}
+
+bool ObjectStore::LoadCb(std::string const& Hash, std::function<void(JSONDeserializer&)> const& Func) const {
+    TransferPool<JSONDeserializer>::Handle Deser = TransferPool<JSONDeserializer>::Acquire();
+    {
+        StoreLock Lock(Directory, LOCK_SH);
+        std::vector<uint8_t> Scratch;
+        Deser->Data = nlohmann::json { { "$ref", Hash } };
+        if (!Resolve(*this, Deser->Data, *Deser, Scratch)) return false;
+    }
+
+    Func(*Deser);
+    return true;
+}
+
+ObjectStore::CollectStats ObjectStore::Collect() {
+    StoreLock Lock(Directory, LOCK_EX);
+    CollectStats Res;
+
+    // Mark. Refs and chunk references lead to JSON chunks, blobs are only marked.
+    std::unordered_set<std::string> Marked;
+    std::unordered_set<std::string> Visited;
+    std::vector<std::string> Chunks;
+    for (std::string const& Name : ListRefs()) {
+        if (std::optional<std::string> Hash = GetRef(Name)) Chunks.push_back(*Hash);
+    }
+
+    std::vector<uint8_t> Contents;
+    std::vector<nlohmann::json const*> Nodes;
+    while (!Chunks.empty()) {
+        std::string Hash = std::move(Chunks.back());
+        Chunks.pop_back();
+        if (!Visited.insert(Hash).second) continue;
+        Marked.insert(Hash);
+
+        nlohmann::json Chunk;
+        try {
+            if (!Get(Hash, Contents)) continue;
+            Chunk = nlohmann::json::parse(Contents.begin(), Contents.end());
+        } catch (nlohmann::json::parse_error const&) {
+            continue;
+        }
+
+        Nodes.assign(1, &Chunk);
+        while (!Nodes.empty()) {
+            nlohmann::json const& Node = *Nodes.back();
+            Nodes.pop_back();
+            if (!Node.is_object()) continue;
+
+            if (auto It = Node.find("$ref"); It != Node.end() && It->is_string()) {
+                Chunks.push_back(It->get<std::string>());
+            }
+            if (auto It = Node.find("$groups"); It != Node.end() && It->is_array()) {
+                for (nlohmann::json const& Group : *It) {
+                    if (Group.is_string()) Chunks.push_back(Group.get<std::string>());
+                }
+            }
+            if (auto It = Node.find("$blob"); It != Node.end() && It->is_string()) {
+                Marked.insert(It->get<std::string>());
+            }
+            for (nlohmann::json const& Child : Node) {
+                Nodes.push_back(&Child);
+            }
+        }
+    }
+
+    // Sweep, including temporaries left by interrupted writes
+    std::error_code Error;
+    for (auto const& Fanout : std::filesystem::directory_iterator(Directory + "/objects", Error)) {
+        if (!Fanout.is_directory()) continue;
+        std::string Prefix = Fanout.path().filename().string();
+        for (auto const& Entry : std::filesystem::directory_iterator(Fanout.path(), Error)) {
+            std::string Hash = Prefix + Entry.path().filename().string();
+            if (Marked.count(Hash)) {
+                ++Res.Kept;
+                continue;
+            }
+            std::error_code SizeError;
+            uint64_t Size = Entry.file_size(SizeError);
+            if (std::filesystem::remove(Entry.path(), Error)) {
+                ++Res.Removed;
+                if (!SizeError) Res.BytesFreed += Size;
+            }
+        }
+    }
+    return Res;
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include "Transfer.hpp"
+
+#include <atomic>
+
+class ObjectStore;
+
+// Serializer that writes a value into an ObjectStore as a tree of chunks.
+// Every scope is encoded as JSON on its own. Scopes with more than GroupSize
+// members are split into groups of consecutive members, one chunk per group,
+// so appending to a Vector only rewrites its last group. Scopes whose JSON
+// reaches ChunkThreshold are stored as a chunk and referenced by hash, so
+// identical subtrees are stored once. Byte payloads are stored as blobs.
+struct StoreSerializer : public NamedScopes {
+    ObjectStore& Store;
+
+    struct Frame {
+        std::string Name;
+        nlohmann::json Data;
+
+        // Member names in the order they were pushed
+        std::vector<std::string> Order;
+    };
+
+    std::vector<Frame> Frames;
+
+    SharedSendTable Shared;
+
+    // Set if any chunk could not be written
+    bool Failed = false;
+
+    inline StoreSerializer(ObjectStore& Store)
+    : Store(Store), Frames(1) { }
+
+    nlohmann::json& AtChecked(std::string const& Name) {
+        Frame& Top = Frames.back();
+        if (Top.Data.contains(Name)) throw StreamTransferError { "Name " + Name + " already in use\n" };
+        Top.Order.push_back(Name);
+        return Top.Data[Name];
+    }
+
+    template<typename T>
+    requires (!Primitive<T> && !std::is_enum<T>::value)
+    inline void Push(std::string const& Name, const T& Val) {
+        BeginScope(Name);
+        Val.Send(*this);
+        EndScope();
+    }
+
+    template<typename T>
+    requires (Primitive<T>)
+    inline void Push(std::string const& Name, const T& Val) {
+        AtChecked(Name) = Val;
+    }
+
+    template<typename T>
+    requires (std::is_enum<T>::value)
+    inline void Push(std::string const& Name, const T& Val) {
+        AtChecked(Name) = static_cast<typename std::underlying_type<T>::type>(Val);
+    }
+
+    void PushBytes(std::string const& Name, std::span<const uint8_t> Bytes, size_t Alignment = 1);
+
+    void PushFileRange(std::string const& Name, std::shared_ptr<FileHandle> const& File, uint64_t Offset, uint64_t Length);
+
+    inline virtual void BeginScope(std::string const& Name) override {
+        if (Frames.back().Data.contains(Name)) throw StreamTransferError { "Name " + Name + " already in use\n" };
+        Frames.push_back(Frame { Name, nullptr, { } });
+    }
+
+    virtual void EndScope() override;
+
+    // Stores the top level scope, returning its hash
+    std::optional<std::string> Finish();
+
+private:
+    // Groups and chunks Top's members as needed, giving the value to embed in its parent
+    nlohmann::json Seal(Frame& Top, bool Root);
+};
+
+// Content addressed store under a directory. Objects live in objects/ under
+// the hex SHA-256 of their bytes and are never rewritten; the hash is strong
+// enough that an existing name is taken as the same bytes. Named refs in
+// refs/ point at snapshot roots, and Collect deletes whatever no ref reaches.
+class ObjectStore {
+public:
+    struct Options {
+        // Scopes whose JSON reaches this many bytes get their own chunk
+        size_t ChunkThreshold = 1024;
+
+        // Scopes with more members than this are split into groups of this many
+        size_t GroupSize = 32;
+    };
+
+    struct Stats {
+        uint64_t Written = 0;
+        uint64_t Deduplicated = 0;
+    };
+
+    struct CollectStats {
+        uint64_t Kept = 0;
+        uint64_t Removed = 0;
+        uint64_t BytesFreed = 0;
+    };
+
+    const std::string Directory;
+    const Options Opts;
+
+    // Null if the directory cannot be created
+    static std::shared_ptr<ObjectStore> Open(std::string const& Directory, Options Opts);
+    static std::shared_ptr<ObjectStore> Open(std::string const& Directory) { return Open(Directory, Options()); }
+
+    // Stores Bytes unless an object with the same hash exists, returning the hash
+    std::optional<std::string> Put(std::span<const uint8_t> Bytes);
+
+    bool Get(std::string const& Hash, std::vector<uint8_t>& Out) const;
+
+    bool Contains(std::string const& Hash) const;
+
+    // Ref names may not contain '/' or start with '.'
+    bool SetRef(std::string const& Name, std::string const& Hash);
+    std::optional<std::string> GetRef(std::string const& Name) const;
+    bool DeleteRef(std::string const& Name);
+    std::vector<std::string> ListRefs() const;
+
+    // Stores a snapshot of whatever Func sends, returning its root hash. Ref,
+    // when not empty, is pointed at it before Collect can run.
+    std::optional<std::string> SaveCb(std::function<void(StoreSerializer&)> const& Func, std::string const& Ref = "");
+
+    // Rebuilds the snapshot at Hash and hands it to Func, false if it is missing
+    bool LoadCb(std::string const& Hash, std::function<void(JSONDeserializer&)> const& Func) const;
+
+    template<typename T>
+    std::optional<std::string> Save(T const& Value, std::string const& Ref = "") {
+        return SaveCb([&Value](StoreSerializer& Ser) {
+            Value.Send(Ser);
+        }, Ref);
+    }
+
+    template<typename T>
+    bool Load(std::string const& Hash, T& Value) const {
+        return LoadCb(Hash, [&Value](JSONDeserializer& Deser) {
+            Value.Receive(Deser);
+        });
+    }
+
+    template<typename T>
+    bool LoadRef(std::string const& Ref, T& Value) const {
+        std::optional<std::string> Hash = GetRef(Ref);
+        return Hash && Load(*Hash, Value);
+    }
+
+    // Deletes every object not reachable from a ref. Saves and loads wait while
+    // it runs, in this process and others.
+    CollectStats Collect();
+
+    Stats GetStats() const {
+        return { Written.load(), Deduplicated.load() };
+    }
+
+private:
+    std::atomic<uint64_t> Written = 0;
+    std::atomic<uint64_t> Deduplicated = 0;
+
+    ObjectStore(std::string Directory, Options Opts);
+
+    std::string ObjectPath(std::string const& Hash) const;
+};
@@ -0,0 +1,465 @@
+#include "OpenAI.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "Transfer.hpp"
+
+static std::string ReadKey(std::string const& Path) {
+    std::ifstream File(Path);
+    if (!File.is_open()) {
+        return std::string();
+    }
+
+    std::stringstream Stream;
+    Stream << File.rdbuf();
+    std::string Key = Stream.str();
+
+    // A trailing newline would end the header early
+    while (!Key.empty() && std::isspace(static_cast<unsigned char>(Key.back()))) {
+        Key.pop_back();
+    }
+    return Key;
+}
+
+// A request on its way out, kept whole so it can be sent again
+struct OpenAI::Call {
+    std::string Text;
+    ResponseCache::Key Key;
+    std::string Body;
+    CompletionOptions Extra;
+    std::function<void(std::string)> Done;
+    size_t Tokens;
+    size_t Attempt = 0;
+
+    // Of the current try
+    RateLimiter::Clock::time_point Started;
+};
+
+// Requests still work without the cache, they just always go out
+static std::shared_ptr<ResponseCache> OpenCache(OpenAI::Options const& Opts) {
+    if (Opts.CachePath.empty()) return nullptr;
+    std::shared_ptr<ResponseCache> Res = ResponseCache::Open(Opts.CachePath, Opts.CacheBytes);
+    if (!Res) std::cout << "Could not open response cache " << Opts.CachePath << "\n";
+    return Res;
+}
+
+OpenAI::OpenAI(Options Opts)
+: Opts(Opts), CompletionsURL(Opts.BaseURL + "/completions"), Cache(OpenCache(Opts)), Records(Opts.LogPath, Cache), Limiter(Opts.Limits), Engine(Client, HttpEngine::Options { Opts.Limits.MaxConcurrent }) {
+    Headers.Append("Content-Type: application/json");
+    Headers.Append("Authorization: Bearer " + ReadKey(Opts.KeyPath));
+}
+
+OpenAI::~OpenAI() {
+    // Waiting requests finish empty now, while the engine can still take the ones already let through
+    Limiter.Stop();
+}
+
+OpenAI& OpenAI::Default() {
+    static OpenAI Instance { Options() };
+    return Instance;
+}
+
+void OpenAI::Prewarm(size_t Connections) {
+    Engine.Prewarm(Opts.BaseURL + "/models", Connections);
+}
+
+std::string OpenAI::Body(std::string const& Text, std::string const& Stop, size_t MaxTokens, double Temperature, bool Stream) const {
+    if (MaxTokens > 100) MaxTokens = 100;
+
+    nlohmann::json Request = {
+        {"model", Opts.Model},
+        {"prompt", Text },
+        {"temperature", Temperature},
+        {"max_tokens", MaxTokens }
+    };
+
+    if (!Stop.empty()) {
+        Request["stop"] = Stop;
+    }
+
+    if (Stream) {
+        Request["stream"] = true;
+    }
+
+    return Request.dump();
+}
+
+bool OpenAI::Finish(HttpResponse const& Res, std::string& Out) {
+    // Only the completion text is decoded, the rest of the response is just indexed
+    IndexedDeserializer Parsed;
+
+    try {
+        Parsed.Load(Res.Body);
+    } catch (StreamTransferError er) {
+        std::cout << "Result Parse Failed!\n" << Res.Body << "\n\n";
+        Out.clear();
+        return false;
+    }
+
+    try {
+        Parsed.BeginScope("choices");
+        Parsed.BeginScope("0");
+        Out = Parsed.Consume<std::string>("text");
+    } catch (StreamTransferError er) {
+        Out = ErrorText(Res.Body);
+        return false;
+    }
+
+    return true;
+}
+
+std::string OpenAI::ErrorText(std::string const& Body) {
+    // Pretty printed when it is JSON, such as an error object, else as it came
+    try {
+        return nlohmann::json::parse(Body).dump(4);
+    } catch (nlohmann::json::exception const&) {
+        return Body;
+    }
+}
+
+void OpenAI::Completed(std::string const& Text, ResponseCache::Key const& Key, std::string const& Completion) {
+    Records.Add(Text, Completion, Key);
+}
+
+std::string OpenAI::FromCache(std::string const& Text, std::string Completion, CompletionOptions const& Extra) {
+    if (Extra.StopAt) {
+        size_t Keep = Extra.StopAt(Completion);
+        if (Keep < Completion.size()) Completion.resize(Keep);
+    }
+    if (Extra.OnToken && !Completion.empty()) Extra.OnToken(Completion);
+
+    Log(Text, Completion);
+    return Completion;
+}
+
+std::string OpenAI::Complete(std::string const& Text, std::string const& Stop, size_t MaxTokens, double Temperature, CompletionOptions const& Extra) {
+    return CompleteAsync(Text, Stop, MaxTokens, Temperature, Extra).get();
+}
+
+void OpenAI::CompleteAsync(std::string const& Text, std::string const& Stop, size_t MaxTokens, double Temperature, std::function<void(std::string)> Done, CompletionOptions const& Extra) {
+    // Keyed on the request as sent, less the stream flag, so it covers every parameter
+    std::string Plain = Body(Text, Stop, MaxTokens, Temperature, false);
+    ResponseCache::Key Key = ResponseCache::KeyOf(Plain);
+    if (Cache && Temperature <= Opts.CacheMaxTemperature) {
+        if (std::optional<std::string> Hit = Cache->Get(Key)) {
+            Done(FromCache(Text, std::move(*Hit), Extra));
+            return;
+        }
+    }
+
+    bool Stream = Extra.OnToken || Extra.StopAt;
+    CompletionOptions Sent = Extra;
+
+    // Where StopAt cuts is up to each caller, so those requests always go alone
+    if (Opts.CoalesceRequests && !Extra.StopAt) {
+        FlightKey Id { Key.A, Key.B, Stream, Extra.Priority };
+        std::shared_ptr<Flight> Lead;
+
+        std::unique_lock<std::mutex> Lock(FlightsMutex);
+        auto Found = Flights.find(Id);
+        if (Found != Flights.end()) {
+            // Taken before letting go of the map, so the flight cannot land in between
+            std::lock_guard<std::mutex> Joining(Found->second->Mutex);
+            Lock.unlock();
+            if (Extra.OnToken && !Found->second->Received.empty()) {
+                Extra.OnToken(Found->second->Received);
+            }
+            Found->second->Waiters.push_back(Flight::Waiter { std::move(Done), Extra.OnToken, Extra.OnWait });
+            return;
+        }
+
+        Lead = std::make_shared<Flight>();
+        Lead->Waiters.push_back(Flight::Waiter { std::move(Done), Extra.OnToken, Extra.OnWait });
+        Flights.emplace(Id, Lead);
+        Lock.unlock();
+
+        Done = [this, Id, Lead](std::string Completion) {
+            Land(Id, *Lead, std::move(Completion));
+        };
+        if (Stream) {
+            Sent.OnToken = [Lead](std::string_view Token) {
+                std::lock_guard<std::mutex> Lock(Lead->Mutex);
+                Lead->Received.append(Token);
+                for (Flight::Waiter& Waiting : Lead->Waiters) {
+                    Waiting.OnToken(Token);
+                }
+            };
+        }
+        Sent.OnWait = [Lead](RateLimiter::Status const& Waiting) {
+            std::lock_guard<std::mutex> Lock(Lead->Mutex);
+            for (Flight::Waiter& Joined : Lead->Waiters) {
+                if (Joined.OnWait) Joined.OnWait(Waiting);
+            }
+        };
+    }
+
+    // Roughly four characters a token, and the reply may use all it is allowed
+    size_t Tokens = Text.size() / 4 + std::min<size_t>(MaxTokens, 100);
+    std::shared_ptr<Call> Sending(new Call { Text, Key, Stream ? Body(Text, Stop, MaxTokens, Temperature, true) : std::move(Plain), std::move(Sent), std::move(Done), Tokens });
+    Limiter.Submit(Sending->Extra.Priority, Tokens, [this, Sending](bool Run) {
+        Send(Sending, Run);
+    }, Sending->Extra.OnWait);
+}
+
+void OpenAI::Send(std::shared_ptr<Call> const& Sending, bool Run) {
+    if (!Run) {
+        Sending->Done("");
+        return;
+    }
+
+    Sending->Started = RateLimiter::Clock::now();
+    HttpRequest Request { CompletionsURL, &Headers, Sending->Body };
+    if (Sending->Extra.OnToken || Sending->Extra.StopAt) {
+        SendStreaming(Sending, std::move(Request));
+        return;
+    }
+
+    Engine.Submit(std::move(Request), [this, Sending](HttpResponse& Res) {
+        Limiter.Finished(Res, Sending->Started, Sending->Tokens);
+        if (RetryLater(Sending, Res)) return;
+
+        std::string Completion;
+        if (Finish(Res, Completion)) {
+            Completed(Sending->Text, Sending->Key, Completion);
+        }
+        Sending->Done(std::move(Completion));
+    });
+}
+
+bool OpenAI::RetryLater(std::shared_ptr<Call> const& Sending, HttpResponse const& Res) {
+    if (!RateLimiter::Retryable(Res)) return false;
+
+    return Limiter.Retry(++Sending->Attempt, Res, Sending->Extra.Priority, Sending->Tokens, [this, Sending](bool Run) {
+        Send(Sending, Run);
+    }, Sending->Extra.OnWait);
+}
+
+void OpenAI::Land(FlightKey const& Id, Flight& Landing, std::string Completion) {
+    {
+        std::lock_guard<std::mutex> Lock(FlightsMutex);
+        Flights.erase(Id);
+    }
+
+    // Nobody can join once it is out of the map
+    std::vector<Flight::Waiter> Waiters;
+    {
+        std::lock_guard<std::mutex> Lock(Landing.Mutex);
+        Waiters.swap(Landing.Waiters);
+    }
+
+    for (size_t i = 0; i < Waiters.size(); ++i) {
+        Waiters[i].Done(i + 1 == Waiters.size() ? std::move(Completion) : Completion);
+    }
+}
+
+std::future<std::string> OpenAI::CompleteAsync(std::string const& Text, std::string const& Stop, size_t MaxTokens, double Temperature, CompletionOptions const& Extra) {
+    std::shared_ptr<std::promise<std::string>> Promise = std::make_shared<std::promise<std::string>>();
+    std::future<std::string> Res = Promise->get_future();
+    CompleteAsync(Text, Stop, MaxTokens, Temperature, [Promise](std::string Completion) {
+        Promise->set_value(std::move(Completion));
+    }, Extra);
+    return Res;
+}
+
+namespace {
+
+// Completion assembled from a stream of events. Touched only by the engine thread.
+struct StreamState {
+    EventStreamParser Events;
+    IndexedDeserializer Parsed;
+    std::string Completion;
+
+    // Set by the first event. Until then the body is kept, as an error comes back as plain JSON.
+    bool Streaming = false;
+    std::string Raw;
+
+    // StopAt fired, so the rest of the reply is not wanted
+    bool Stopped = false;
+
+    // The server ended with [DONE]. Without it the reply was cut off part way.
+    bool Whole = false;
+
+    // Data of the last event that held no text, such as an error, unless text came after it
+    std::string Error;
+};
+
+}
+
+std::function<size_t(std::string_view)> StopBefore(std::string Text) {
+    return [Text = std::move(Text)](std::string_view Received) {
+        return Received.find(Text);
+    };
+}
+
+void OpenAI::SendStreaming(std::shared_ptr<Call> const& Sending, HttpRequest Request) {
+    std::shared_ptr<StreamState> State = std::make_shared<StreamState>();
+    CompletionOptions const& Extra = Sending->Extra;
+
+    State->Events.OnEvent = [State = State.get(), OnToken = Extra.OnToken, StopAt = Extra.StopAt](std::string_view Data) {
+        State->Streaming = true;
+        if (Data == "[DONE]") State->Whole = true;
+        if (State->Stopped || State->Whole) return;
+
+        std::string Token;
+        try {
+            State->Parsed.Load(Data);
+            State->Parsed.BeginScope("choices");
+            State->Parsed.BeginScope("0");
+            Token = State->Parsed.Consume<std::string>("text");
+        } catch (StreamTransferError er) {
+            State->Error = Data;
+            return;
+        }
+        State->Error.clear();
+
+        if (Token.empty()) return;
+        size_t Before = State->Completion.size();
+        State->Completion += Token;
+
+        if (StopAt) {
+            size_t Keep = StopAt(State->Completion);
+            if (Keep != std::string::npos) {
+                State->Stopped = true;
+                State->Completion.resize(std::min(Keep, State->Completion.size()));
+                Token.resize(State->Completion.size() > Before ? State->Completion.size() - Before : 0);
+            }
+        }
+
+        if (OnToken && !Token.empty()) OnToken(Token);
+    };
+
+    // Returning false aborts the transfer from inside curl's write callback
+    Request.OnData = [State](std::string_view Bytes) {
+        if (!State->Streaming) State->Raw.append(Bytes);
+        State->Events.Feed(Bytes);
+        return !State->Stopped;
+    };
+
+    Engine.Submit(std::move(Request), [this, Sending, State](HttpResponse& Res) {
+        Limiter.Finished(Res, Sending->Started, Sending->Tokens);
+
+        // Only retried if nothing was passed on yet, which holds for any error status
+        if (!State->Streaming) {
+            if (RetryLater(Sending, Res)) return;
+
+            Res.Body = std::move(State->Raw);
+            std::string Completion;
+            if (Finish(Res, Completion)) {
+                Completed(Sending->Text, Sending->Key, Completion);
+            }
+            Sending->Done(std::move(Completion));
+            return;
+        }
+
+        // A request cut off by StopAt ends in a write error, which is expected.
+        // Only whole replies are cached, as the cut depends on the caller.
+        if (State->Stopped) {
+            Log(Sending->Text, State->Completion);
+        } else if (Res.Ok() && State->Whole) {
+            Completed(Sending->Text, Sending->Key, State->Completion);
+        } else {
+            // Dropped part way or ended by an error event, so never cached. The
+            // error is returned in place of the text, as Finish would.
+            if (State->Completion.empty() && RetryLater(Sending, Res)) return;
+            if (!State->Error.empty()) State->Completion = ErrorText(State->Error);
+            Log(Sending->Text, State->Completion);
+        }
+        Sending->Done(std::move(State->Completion));
+    });
+}
+
+namespace {
+
+struct CompletionAwaiter {
+    OpenAI& Client;
+    std::string const& Text;
+    std::string const& Stop;
+    size_t MaxTokens;
+    double Temperature;
+    CompletionOptions const& Extra;
+
+    std::string Result;
+
+    bool await_ready() noexcept { return false; }
+
+    // The callback may resume the coroutine on another thread before this
+    // returns, so nothing here touches the awaiter after submitting
+    void await_suspend(std::coroutine_handle<> Handle) {
+        Executor& Exec = ResumeExecutor();
+        Client.CompleteAsync(Text, Stop, MaxTokens, Temperature, [this, Handle, &Exec](std::string Completion) {
+            Result = std::move(Completion);
+            Exec.Post(Handle);
+        }, Extra);
+    }
+
+    std::string await_resume() {
+        return std::move(Result);
+    }
+};
+
+}
+
+Task<std::string> OpenAI::CompleteTask(std::string Text, std::string Stop, size_t MaxTokens, double Temperature, CompletionOptions Extra) {
+    // Named, as GCC 12 miscompiles co_await on a temporary awaiter with non-trivial members
+    CompletionAwaiter Awaiter { *this, Text, Stop, MaxTokens, Temperature, Extra };
+    co_return co_await Awaiter;
+}
+
+void OpenAI::Log(std::string const& Text, std::string const& Completion) {
+    Records.Add(Text, Completion, std::nullopt);
+}
+
+OpenAI::Recorder::Recorder(std::string LogPath, std::shared_ptr<ResponseCache> Cache)
+: LogPath(std::move(LogPath)), Cache(std::move(Cache)) {
+    Loop = std::thread([this]() {
+        Run();
+    });
+}
+
+OpenAI::Recorder::~Recorder() {
+    {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        Stopping = true;
+    }
+    Wake.notify_one();
+    Loop.join();
+}
+
+void OpenAI::Recorder::Add(std::string Text, std::string Completion, std::optional<ResponseCache::Key> Key) {
+    if (LogPath.empty() && !(Key && Cache)) return;
+    {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        Queue.push_back(Entry { std::move(Text), std::move(Completion), Key });
+    }
+    Wake.notify_one();
+}
+
+void OpenAI::Recorder::Run() {
+    // Opened on first use, so a run that never completes anything leaves no file
+    std::ofstream Log;
+
+    std::deque<Entry> Writing;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> Lock(Mutex);
+            Wake.wait(Lock, [this]() {
+                return Stopping || !Queue.empty();
+            });
+            if (Queue.empty()) return;
+            Writing.swap(Queue);
+        }
+
+        for (Entry& Done : Writing) {
+            if (Done.Key && Cache) Cache->Put(*Done.Key, Done.Completion);
+            if (LogPath.empty()) continue;
+
+            if (!Log.is_open()) Log.open(LogPath, std::ios::app | std::ios::binary);
+            Log << nlohmann::json(Done.Text + Done.Completion).dump() << "\n";
+        }
+        Log.flush();
+        Writing.clear();
+    }
+}
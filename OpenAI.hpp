@@ -0,0 +1,226 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "HttpClient.hpp"
+#include "HttpEngine.hpp"
+#include "RateLimiter.hpp"
+#include "ResponseCache.hpp"
+#include "Task.hpp"
+
+// Per request settings beyond the prompt itself
+struct CompletionOptions {
+    // When set the completion is streamed, and each piece is handed here as
+    // it arrives, on the engine thread. Text that arrived before the request
+    // was made, from the cache or a shared request, is handed over at once on
+    // the calling thread. The full text is still returned.
+    std::function<void(std::string_view)> OnToken;
+
+    // When set the completion is streamed, and this is asked after each piece
+    // arrives whether the reply is done. It gets all the text so far and
+    // returns npos to keep going, or how much of it to keep. The request is
+    // then cut off and the kept text returned. OnToken is not called past
+    // the cut, though it may have seen text the cut later takes back.
+    std::function<size_t(std::string_view)> StopAt;
+
+    // Told when the request is held back by the rate limit or waits to be
+    // retried, on the limiter or engine thread
+    RateLimiter::StatusCallback OnWait;
+
+    // Which queue the request waits in for budget and a free slot
+    RequestPriority Priority = RequestPriority::Interactive;
+};
+
+// StopAt ending the reply just before the first occurrence of Text
+std::function<size_t(std::string_view)> StopBefore(std::string Text);
+
+// Completions client. The key and request headers are loaded once and the
+// HTTP client is kept for the life of the process, so requests after the
+// first reuse its connection. Requests run on an HttpEngine, so any number
+// can be in flight at once from any thread.
+class OpenAI {
+public:
+    struct Options {
+        std::string BaseURL = "https://api.openai.com/v1";
+        std::string KeyPath = "../openai-key.txt";
+        std::string Model = "text-davinci-003";
+
+        // Every prompt and completion is appended here as a line holding one
+        // JSON string, empty to disable
+        std::string LogPath = "RequestLog.jsonl";
+
+        // Completed replies are kept here across runs, empty to disable
+        std::string CachePath = "ResponseCache.bin";
+        size_t CacheBytes = 16 * 1024 * 1024;
+
+        // Cached replies are reused only for requests at or below this
+        // temperature. At 0 the reply would be the same anyway. Above it a
+        // cached reply stands in for a fresh sample, so a repeated prompt
+        // always gets the same answer; raise it to replay scripted sessions
+        // for free. Replies are stored whatever their temperature.
+        double CacheMaxTemperature = 0.0;
+
+        // A request identical to one already in flight waits for that one's
+        // reply instead of making its own call. Above temperature 0 they all
+        // get the same sample.
+        bool CoalesceRequests = true;
+
+        // Budgets, retries and concurrency. Budgets left at 0 are learned from
+        // the first response; concurrency adapts within its bounds.
+        RateLimiter::Options Limits;
+    };
+
+    const Options Opts;
+
+    OpenAI(Options Opts);
+
+    // Requests still waiting on the rate limit or in flight finish empty
+    ~OpenAI();
+
+    // Completion text, an error body pretty printed if the API returned one, or empty
+    std::string Complete(std::string const& Text, std::string const& Stop, size_t MaxTokens, double Temperature, CompletionOptions const& Extra = {});
+
+    // As Complete without waiting. Done runs on the engine thread and should
+    // not block, or on the calling thread before this returns if the reply is cached.
+    void CompleteAsync(std::string const& Text, std::string const& Stop, size_t MaxTokens, double Temperature, std::function<void(std::string)> Done, CompletionOptions const& Extra = {});
+    std::future<std::string> CompleteAsync(std::string const& Text, std::string const& Stop, size_t MaxTokens, double Temperature, CompletionOptions const& Extra = {});
+
+    // As Complete, suspending the calling coroutine rather than blocking its
+    // thread. It resumes on the executor it was running on.
+    Task<std::string> CompleteTask(std::string Text, std::string Stop, size_t MaxTokens, double Temperature, CompletionOptions Extra = {});
+
+    // Concurrency limit and requests in flight and waiting, as of now
+    RateLimiter::Load Load() { return Limiter.Current(); }
+
+    // Connects to the API host ahead of the first request
+    void Prewarm(size_t Connections = 1);
+
+    // The process wide client, created with default options on first use
+    static OpenAI& Default();
+
+    static std::string Request(std::string const& Text, std::string const& Stop, size_t MaxTokens, double Temperature, CompletionOptions const& Extra = {}) {
+        return Default().Complete(Text, Stop, MaxTokens, Temperature, Extra);
+    }
+
+    static std::future<std::string> RequestAsync(std::string const& Text, std::string const& Stop, size_t MaxTokens, double Temperature, CompletionOptions const& Extra = {}) {
+        return Default().CompleteAsync(Text, Stop, MaxTokens, Temperature, Extra);
+    }
+
+    static Task<std::string> RequestTask(std::string Text, std::string Stop, size_t MaxTokens, double Temperature, CompletionOptions Extra = {}) {
+        return Default().CompleteTask(std::move(Text), std::move(Stop), MaxTokens, Temperature, std::move(Extra));
+    }
+
+private:
+    HttpClient Client;
+    HttpHeaders Headers;
+    std::string CompletionsURL;
+
+    // Null if disabled or it could not be opened
+    std::shared_ptr<ResponseCache> Cache;
+
+    // Appends to the log and stores replies in the cache on a thread of its
+    // own, as replies land on the engine thread, which must not wait on
+    // files. Writes what is still queued before it is destroyed.
+    class Recorder {
+    public:
+        Recorder(std::string LogPath, std::shared_ptr<ResponseCache> Cache);
+        ~Recorder();
+
+        // With Key, Completion is cached under it as well as logged
+        void Add(std::string Text, std::string Completion, std::optional<ResponseCache::Key> Key);
+
+    private:
+        struct Entry {
+            std::string Text;
+            std::string Completion;
+            std::optional<ResponseCache::Key> Key;
+        };
+
+        const std::string LogPath;
+        const std::shared_ptr<ResponseCache> Cache;
+
+        std::mutex Mutex;
+        std::condition_variable Wake;
+        std::deque<Entry> Queue;
+        bool Stopping = false;
+
+        std::thread Loop;
+
+        void Run();
+    };
+
+    // Outlives the engine and limiter, whose callbacks record into it
+    Recorder Records;
+
+    // Callers sharing one request in flight. The first sends it, the rest
+    // join, and everyone gets the reply when it lands.
+    struct Flight {
+        struct Waiter {
+            std::function<void(std::string)> Done;
+            std::function<void(std::string_view)> OnToken;
+            RateLimiter::StatusCallback OnWait;
+        };
+
+        std::mutex Mutex;
+        std::vector<Waiter> Waiters;
+
+        // Streamed text so far, replayed to callers that join part way
+        std::string Received;
+    };
+
+    // Request key, whether it streams and its priority, as only flights of
+    // the same kind are shared and nobody should wait behind a lower class
+    using FlightKey = std::tuple<uint64_t, uint64_t, bool, RequestPriority>;
+
+    std::mutex FlightsMutex;
+    std::map<FlightKey, std::shared_ptr<Flight>> Flights;
+
+    // Stopped first in the destructor, as its jobs send on the engine, but
+    // outlives the engine, as finished requests report back to it
+    RateLimiter Limiter;
+
+    // Last, so it stops before anything its requests use is destroyed
+    HttpEngine Engine;
+
+    struct Call;
+
+    std::string Body(std::string const& Text, std::string const& Stop, size_t MaxTokens, double Temperature, bool Stream) const;
+
+    // One try of a request, once the rate limit lets it go
+    void Send(std::shared_ptr<Call> const& Sending, bool Run);
+
+    // As Send for requests with "stream" set, passing text on as events arrive
+    void SendStreaming(std::shared_ptr<Call> const& Sending, HttpRequest Request);
+
+    // Queues another try if the response is worth retrying and tries remain
+    bool RetryLater(std::shared_ptr<Call> const& Sending, HttpResponse const& Res);
+
+    // Completion text from a finished request, as Complete returns it. False
+    // if it failed, leaving the error body or nothing in Out.
+    static bool Finish(HttpResponse const& Res, std::string& Out);
+
+    // An error body as Complete returns it, pretty printed if it is JSON
+    static std::string ErrorText(std::string const& Body);
+
+    // Hands a flight's reply to everyone waiting on it
+    void Land(FlightKey const& Id, Flight& Landing, std::string Completion);
+
+    // Logs and caches a reply that came back whole
+    void Completed(std::string const& Text, ResponseCache::Key const& Key, std::string const& Completion);
+
+    // A cached reply as the request would have returned it
+    std::string FromCache(std::string const& Text, std::string Completion, CompletionOptions const& Extra);
+
+    void Log(std::string const& Text, std::string const& Completion);
+};
@@ -0,0 +1,284 @@
+#include "RateLimiter.hpp"
+
+#include <cstdlib>
+#include <iterator>
+
+using namespace std::chrono;
+
+RateLimiter::RateLimiter(Options Opts)
+: Opts(Opts), Refilled(Clock::now()), Limit(Opts.InitialConcurrent), Random(std::random_device()()) {
+    Requests.SetCapacity(Opts.RequestsPerMinute);
+    Tokens.SetCapacity(Opts.TokensPerMinute);
+    Loop = std::thread([this]() {
+        Run();
+    });
+}
+
+RateLimiter::~RateLimiter() {
+    Stop();
+}
+
+void RateLimiter::Stop() {
+    {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        Stopping = true;
+    }
+    Changed.notify_all();
+    if (Loop.joinable()) Loop.join();
+}
+
+void RateLimiter::Submit(RequestPriority Class, size_t Cost, Job Start, StatusCallback OnStatus) {
+    {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        if (!Stopping) {
+            EnqueueLocked(Item { Class, Cost, 0, std::move(Start), std::move(OnStatus) }, false);
+            Start = nullptr;
+        }
+    }
+    if (Start) {
+        Start(false);
+        return;
+    }
+    Changed.notify_all();
+}
+
+bool RateLimiter::Retry(size_t Attempt, HttpResponse const& Failed, RequestPriority Class, size_t Cost, Job Start, StatusCallback OnStatus) {
+    if (Attempt > Opts.MaxRetries) return false;
+
+    // The server's word first, else back off further each time, jittered so
+    // requests that failed together do not all come back together
+    milliseconds Delay = ParseDuration(Failed.Header("retry-after"));
+    bool Queued = false;
+    {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        if (Delay.count() == 0) {
+            milliseconds Ceiling = std::min<milliseconds>(Opts.BackoffMax, Opts.BackoffBase * (1 << std::min<size_t>(Attempt - 1, 20)));
+            std::uniform_int_distribution<long long> Jitter(Ceiling.count() / 2, Ceiling.count());
+            Delay = milliseconds(Jitter(Random));
+        }
+        if (!Stopping) {
+            Delayed.emplace(Clock::now() + Delay, Item { Class, Cost, Attempt, Start, OnStatus, true });
+            Queued = true;
+        }
+    }
+
+    if (!Queued) {
+        Start(false);
+        return true;
+    }
+    Changed.notify_all();
+    if (OnStatus) OnStatus(Status { Attempt, 0, Delay });
+    return true;
+}
+
+static bool ParseNumber(std::string const& Text, double& Out) {
+    if (Text.empty()) return false;
+    char* End = nullptr;
+    Out = std::strtod(Text.c_str(), &End);
+    return End != Text.c_str();
+}
+
+void RateLimiter::Finished(HttpResponse const& Res, Clock::time_point Started, size_t Cost) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Clock::time_point Now = Clock::now();
+    RefillLocked(Now);
+    InFlight--;
+
+    // The server counts requests we have not heard back from yet, so its
+    // remaining figure is only ever allowed to lower ours
+    double Value;
+    if (ParseNumber(Res.Header("x-ratelimit-limit-requests"), Value)) Requests.SetCapacity(Value);
+    if (ParseNumber(Res.Header("x-ratelimit-limit-tokens"), Value)) Tokens.SetCapacity(Value);
+    if (ParseNumber(Res.Header("x-ratelimit-remaining-requests"), Value)) Requests.Level = std::min(Requests.Level, Value);
+    if (ParseNumber(Res.Header("x-ratelimit-remaining-tokens"), Value)) Tokens.Level = std::min(Tokens.Level, Value);
+
+    if (Res.Ok() && Res.Status == 429) {
+        milliseconds Pause = ParseDuration(Res.Header("retry-after"));
+        if (Pause.count() == 0) Pause = Opts.BackoffBase;
+        PausedUntil = std::max(PausedUntil, Now + Pause);
+    }
+
+    if (Retryable(Res)) {
+        DecreaseLocked(Now, Started);
+    } else if (Res.Ok() && Res.Status < 400) {
+        double PerToken = duration<double>(Now - Started).count() / std::max<size_t>(Cost, 1);
+        if (Samples++ == 0 || PerToken < Baseline) {
+            Baseline = PerToken;
+        } else {
+            Baseline += (PerToken - Baseline) / std::max<size_t>(Opts.BaselineSamples, 1);
+        }
+
+        // A few replies first, so one lucky one does not set the bar
+        if (Samples >= 8 && PerToken > Baseline * Opts.LatencyTolerance) {
+            DecreaseLocked(Now, Started);
+        } else {
+            Limit = std::min<double>(Opts.MaxConcurrent, Limit + 1.0 / Limit);
+        }
+    }
+    Changed.notify_all();
+}
+
+void RateLimiter::DecreaseLocked(Clock::time_point Now, Clock::time_point Started) {
+    // Requests already out when the limit was cut saw the old load, so they do not cut it again
+    if (Started < LastDecrease) return;
+    Limit = std::max<double>(Opts.MinConcurrent, Limit * Opts.DecreaseFactor);
+    LastDecrease = Now;
+}
+
+RateLimiter::Load RateLimiter::Current() {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Load Res { Limit, InFlight, 0, Delayed.size() };
+    for (size_t Class = 0; Class < Queues.size(); ++Class) {
+        Res.QueuedByPriority[Class] = Queues[Class].size();
+        Res.Queued += Queues[Class].size();
+    }
+    return Res;
+}
+
+void RateLimiter::EnqueueLocked(Item Waiting, bool Front) {
+    size_t Class = static_cast<size_t>(Waiting.Class);
+
+    // No credit for time spent with nothing to send
+    if (Queues[Class].empty()) {
+        Pass[Class] = std::max(Pass[Class], VirtualTime);
+    }
+
+    if (Front) Queues[Class].push_front(std::move(Waiting));
+    else Queues[Class].push_back(std::move(Waiting));
+}
+
+int RateLimiter::NextClassLocked() const {
+    int Best = -1;
+    for (size_t Class = 0; Class < Queues.size(); ++Class) {
+        if (Queues[Class].empty()) continue;
+        if (Best < 0 || Pass[Class] < Pass[Best]) Best = static_cast<int>(Class);
+    }
+    return Best;
+}
+
+bool RateLimiter::Retryable(HttpResponse const& Res) {
+    switch (Res.Result) {
+    case CURLE_OK:
+        return Res.Status == 429 || Res.Status >= 500;
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+        return true;
+    default:
+        return false;
+    }
+}
+
+milliseconds RateLimiter::ParseDuration(std::string const& Text) {
+    double Total = 0;
+    char const* Pos = Text.c_str();
+    while (*Pos) {
+        char* End = nullptr;
+        double Value = std::strtod(Pos, &End);
+        if (End == Pos) return milliseconds(0);
+        Pos = End;
+
+        if (Pos[0] == 'm' && Pos[1] == 's') { Total += Value / 1000; Pos += 2; }
+        else if (*Pos == 'h') { Total += Value * 3600; Pos++; }
+        else if (*Pos == 'm') { Total += Value * 60; Pos++; }
+        else if (*Pos == 's' || *Pos == 0) { Total += Value; if (*Pos) Pos++; }
+        else return milliseconds(0);
+    }
+    return milliseconds(static_cast<long long>(Total * 1000));
+}
+
+void RateLimiter::RefillLocked(Clock::time_point Now) {
+    double Seconds = duration<double>(Now - Refilled).count();
+    Refilled = Now;
+    Requests.Refill(Seconds);
+    Tokens.Refill(Seconds);
+}
+
+void RateLimiter::Run() {
+    std::unique_lock<std::mutex> Lock(Mutex);
+    while (!Stopping) {
+        Clock::time_point Now = Clock::now();
+        RefillLocked(Now);
+
+        // Retries whose backoff has passed go ahead of new requests of their class, oldest first
+        auto Due = Delayed.upper_bound(Now);
+        for (auto It = std::make_reverse_iterator(Due); It != Delayed.rend(); ++It) {
+            EnqueueLocked(std::move(It->second), true);
+        }
+        Delayed.erase(Delayed.begin(), Due);
+
+        Clock::time_point Wake = Delayed.empty() ? Clock::time_point::max() : Delayed.begin()->first;
+        int Class = NextClassLocked();
+
+        // A free slot is waited for without a timeout, as Finished signals it
+        if (Class < 0 || InFlight >= static_cast<size_t>(Limit)) {
+            if (Wake == Clock::time_point::max()) Changed.wait(Lock);
+            else Changed.wait_until(Lock, Wake);
+            continue;
+        }
+
+        std::deque<Item>& Queue = Queues[Class];
+        Item& Head = Queue.front();
+        double Seconds = std::max(Requests.SecondsUntil(1), Tokens.SecondsUntil(Head.Tokens));
+        Clock::time_point Start = std::max(PausedUntil, Now + duration_cast<Clock::duration>(duration<double>(Seconds)));
+        if (Start <= Now) {
+            Requests.Take(1);
+            Tokens.Take(Head.Tokens);
+            InFlight++;
+            VirtualTime = Pass[Class];
+            Pass[Class] += 1.0 / std::max(Opts.Weights[Class], 1e-9);
+
+            Item Started = std::move(Head);
+            Queue.pop_front();
+            Lock.unlock();
+            Started.Start(true);
+            Lock.lock();
+            continue;
+        }
+
+        // Everyone newly held back hears how long it should be. Higher classes
+        // are counted as ahead, which is close while they keep most starts.
+        std::vector<std::pair<StatusCallback, Status>> Tell;
+        size_t Ahead = 0;
+        double Total = 0;
+        for (std::deque<Item>& Waiting : Queues) {
+            for (Item& Held : Waiting) {
+                Total += Held.Tokens;
+                Ahead++;
+                if (Held.Told || !Held.OnStatus) continue;
+                Held.Told = true;
+
+                double Estimate = std::max(Requests.SecondsFor(Ahead), Tokens.SecondsFor(Total));
+                Clock::time_point Expected = std::max(PausedUntil, Now + duration_cast<Clock::duration>(duration<double>(Estimate)));
+                Tell.emplace_back(Held.OnStatus, Status { Held.Attempt, Ahead - 1, duration_cast<milliseconds>(Expected - Now) });
+            }
+        }
+        if (!Tell.empty()) {
+            Lock.unlock();
+            for (auto& [OnStatus, Waiting] : Tell) {
+                OnStatus(Waiting);
+            }
+            Lock.lock();
+            continue;
+        }
+
+        Changed.wait_until(Lock, std::min(Start, Wake));
+    }
+
+    std::vector<Item> Dropped;
+    for (std::deque<Item>& Waiting : Queues) {
+        std::move(Waiting.begin(), Waiting.end(), std::back_inserter(Dropped));
+        Waiting.clear();
+    }
+    for (auto& [When, Waiting] : Delayed) {
+        Dropped.push_back(std::move(Waiting));
+    }
+    Delayed.clear();
+    Lock.unlock();
+
+    for (Item& Waiting : Dropped) {
+        Waiting.Start(false);
+    }
+}
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "HttpClient.hpp"
+
+// Who is waiting on a request. Lower classes still get a share when higher
+// ones are busy, so they are delayed but never starved.
+enum class RequestPriority {
+    // A user is watching for the reply
+    Interactive,
+
+    // Needed soon but not shown at once, such as checks run after a turn
+    Deferred,
+
+    // Batch work with nobody waiting
+    Bulk
+};
+
+// Holds requests back to stay inside a requests per minute and tokens per
+// minute budget. Each budget is a bucket that refills evenly over a minute,
+// sized from Options and then kept in line with the x-ratelimit headers of
+// every response. Requests start in the order they were queued; one that
+// does not fit waits at the head rather than letting smaller ones past it.
+// A 429 pauses everything until the server's retry time, and requests that
+// failed come back through Retry after a jittered exponential backoff.
+//
+// How many may be in flight at once adapts too, additive increase and
+// multiplicative decrease: each good reply raises the limit by 1/Limit, so
+// about one a round trip, and an overloaded or slow reply cuts it by
+// DecreaseFactor, at most once for requests started before the last cut.
+//
+// Each RequestPriority has its own queue, and the next request to go comes
+// from the class furthest behind its weighted share, stride scheduled. A
+// class that had nothing waiting rejoins at the current point rather than
+// with credit saved up, and ties go to the higher class, so a new
+// interactive request goes next while bulk work still gets its share.
+class RateLimiter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Options {
+        // Starting budgets, 0 for none until a response reports one
+        double RequestsPerMinute = 0;
+        double TokensPerMinute = 0;
+
+        // Without a Retry-After, the wait before retry N, counting from 1, is
+        // a random time between half and all of BackoffBase * 2^(N-1), capped
+        // at BackoffMax
+        std::chrono::milliseconds BackoffBase { 500 };
+        std::chrono::milliseconds BackoffMax { 30000 };
+        size_t MaxRetries = 6;
+
+        // Bounds of the concurrency limit and where it starts
+        size_t MinConcurrent = 1;
+        size_t MaxConcurrent = 32;
+        size_t InitialConcurrent = 8;
+
+        double DecreaseFactor = 0.5;
+
+        // A reply is slow when its time per token is this many times the
+        // baseline. Replies are compared per token, prompt and max_tokens, as
+        // their length sets most of their time.
+        double LatencyTolerance = 2.0;
+
+        // The baseline is the fastest reply, drifting up toward newer ones
+        // over about this many, so a provider that got slower for everyone
+        // becomes the new normal instead of cutting the limit forever
+        size_t BaselineSamples = 500;
+
+        // Share of starts each RequestPriority gets while all are waiting
+        std::array<double, 3> Weights { 16, 4, 1 };
+    };
+
+    struct Load {
+        double Limit = 0;
+        size_t InFlight = 0;
+
+        // Waiting for budget or a free slot, and waiting out a backoff
+        size_t Queued = 0;
+        size_t Delayed = 0;
+
+        std::array<size_t, 3> QueuedByPriority { };
+    };
+
+    // Why a request is not going out yet, for callers that show progress
+    struct Status {
+        // Retries so far, 0 while waiting for the first try
+        size_t Attempt = 0;
+
+        // Requests queued ahead of this one, counting every higher class
+        size_t Ahead = 0;
+
+        // Expected time until it goes out, if nothing else changes
+        std::chrono::milliseconds Wait { 0 };
+    };
+
+    // Run on the limiter thread with true when the request may go, or with
+    // false if the limiter stops first. Should not block.
+    using Job = std::function<void(bool Run)>;
+    using StatusCallback = std::function<void(Status const&)>;
+
+    RateLimiter(Options Opts);
+
+    // Stops, see Stop
+    ~RateLimiter();
+
+    RateLimiter(RateLimiter const&) = delete;
+    RateLimiter& operator=(RateLimiter const&) = delete;
+
+    const Options Opts;
+
+    // Queues a request costing Tokens from the token budget
+    void Submit(RequestPriority Class, size_t Tokens, Job Start, StatusCallback OnStatus = nullptr);
+
+    // Queues a request again after a failed try, ahead of new requests of its
+    // class once its backoff has passed. False once Attempt is past MaxRetries.
+    bool Retry(size_t Attempt, HttpResponse const& Failed, RequestPriority Class, size_t Tokens, Job Start, StatusCallback OnStatus = nullptr);
+
+    // Called once for every job run with true, with its response, when it
+    // started and what it cost. Frees its slot, adjusts the concurrency limit
+    // and brings the budgets in line with the response's headers.
+    void Finished(HttpResponse const& Res, Clock::time_point Started, size_t Tokens);
+
+    Load Current();
+
+    // Runs every waiting job with false and joins the thread. Jobs submitted
+    // or retried afterwards are run with false at once.
+    void Stop();
+
+    // Worth trying again: rate limited, a server error or a dropped connection
+    static bool Retryable(HttpResponse const& Res);
+
+    // "1s", "6m0s", "20ms" and the like from x-ratelimit-reset-*, or plain seconds
+    static std::chrono::milliseconds ParseDuration(std::string const& Text);
+
+private:
+    struct Bucket {
+        // Zero for no limit
+        double Capacity = 0;
+        double Level = 0;
+
+        void Refill(double Seconds) {
+            Level = std::min(Capacity, Level + Capacity * Seconds / 60.0);
+        }
+
+        bool Fits(double Cost) const {
+            return Capacity == 0 || Level >= std::min(Cost, Capacity);
+        }
+
+        // Time until Cost fits, given nothing else is taken
+        double SecondsUntil(double Cost) const {
+            if (Fits(Cost)) return 0;
+            return (std::min(Cost, Capacity) - Level) * 60.0 / Capacity;
+        }
+
+        // Time until Total has been available, for estimating a queue
+        double SecondsFor(double Total) const {
+            if (Capacity == 0 || Total <= Level) return 0;
+            return (Total - Level) * 60.0 / Capacity;
+        }
+
+        void Take(double Cost) {
+            if (Capacity != 0) Level -= std::min(Cost, Capacity);
+        }
+
+        void SetCapacity(double Limit) {
+            if (Capacity == 0) Level = Limit;
+            Capacity = Limit;
+            Level = std::min(Level, Capacity);
+        }
+    };
+
+    struct Item {
+        RequestPriority Class;
+        size_t Tokens;
+        size_t Attempt;
+        Job Start;
+        StatusCallback OnStatus;
+
+        // Told it is waiting, so it is not told again each time round
+        bool Told = false;
+    };
+
+    std::mutex Mutex;
+    std::condition_variable Changed;
+    bool Stopping = false;
+
+    Bucket Requests;
+    Bucket Tokens;
+    Clock::time_point Refilled;
+
+    // Nothing starts before this, set by a 429
+    Clock::time_point PausedUntil;
+
+    double Limit;
+    size_t InFlight = 0;
+    Clock::time_point LastDecrease;
+
+    // Seconds per token, and good replies seen so far
+    double Baseline = 0;
+    size_t Samples = 0;
+
+    std::array<std::deque<Item>, 3> Queues;
+    std::multimap<Clock::time_point, Item> Delayed;
+
+    // Stride scheduling: a class's pass grows by 1 / weight each start, and
+    // the waiting class with the lowest pass goes next
+    std::array<double, 3> Pass { };
+    double VirtualTime = 0;
+
+    std::mt19937 Random;
+
+    std::thread Loop;
+
+    void Run();
+    void RefillLocked(Clock::time_point Now);
+    void DecreaseLocked(Clock::time_point Now, Clock::time_point Started);
+    void EnqueueLocked(Item Waiting, bool Front);
+
+    // The class that goes next, or -1 if nothing is queued
+    int NextClassLocked() const;
+};
@@ -0,0 +1,147 @@
+#include "ResponseCache.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Transfer.hpp"
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Cache counters must be lock free to be shared between processes");
+
+ResponseCache::Key ResponseCache::KeyOf(std::string_view Request) {
+    std::array<uint8_t, 32> Hash = SHA256(reinterpret_cast<const uint8_t*>(Request.data()), Request.size());
+    Key Res;
+    std::memcpy(&Res.A, Hash.data(), sizeof(Res.A));
+    std::memcpy(&Res.B, Hash.data() + sizeof(Res.A), sizeof(Res.B));
+
+    // Zero marks an empty slot
+    if (Res.A == 0) Res.A = 1;
+    return Res;
+}
+
+std::shared_ptr<ResponseCache> ResponseCache::Open(std::string const& Path, size_t Bytes) {
+    int Fd = open(Path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (Fd < 0) return nullptr;
+
+    std::shared_ptr<ResponseCache> Res(new ResponseCache());
+    Res->Fd = Fd;
+
+    // Exclusive while checking the header, so only one process lays out a new table
+    Res->Lock(LOCK_EX);
+
+    Header Existing { };
+    struct stat Info;
+    if (fstat(Fd, &Info) != 0) {
+        Res->Lock(LOCK_UN);
+        return nullptr;
+    }
+    bool Valid = Info.st_size >= (off_t)sizeof(Header)
+        && pread(Fd, &Existing, sizeof(Header), 0) == (ssize_t)sizeof(Header)
+        && Existing.Magic == Magic
+        && Existing.SetCount != 0
+        && Info.st_size == (off_t)(sizeof(Header) + Existing.SetCount * Ways * SlotSize);
+
+    uint64_t SetCount = Valid ? Existing.SetCount : std::max<uint64_t>(1, Bytes / (Ways * SlotSize));
+    Res->MapSize = sizeof(Header) + SetCount * Ways * SlotSize;
+
+    // Anything unrecognised is started over, zero filled, which is every slot empty
+    if (!Valid && (ftruncate(Fd, 0) != 0 || ftruncate(Fd, Res->MapSize) != 0)) {
+        Res->Lock(LOCK_UN);
+        return nullptr;
+    }
+
+    Res->Map = mmap(nullptr, Res->MapSize, PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+    if (Res->Map == MAP_FAILED) {
+        Res->Map = nullptr;
+        Res->Lock(LOCK_UN);
+        return nullptr;
+    }
+    Res->Head = static_cast<Header*>(Res->Map);
+
+    if (!Valid) {
+        Res->Head->SetCount = SetCount;
+        Res->Head->Magic = Magic;
+    }
+    Res->Lock(LOCK_UN);
+    return Res;
+}
+
+ResponseCache::~ResponseCache() {
+    if (Map) munmap(Map, MapSize);
+    if (Fd >= 0) close(Fd);
+}
+
+void ResponseCache::Lock(int Mode) {
+    while (flock(Fd, Mode) != 0 && errno == EINTR) { }
+}
+
+ResponseCache::Slot* ResponseCache::SlotAt(uint64_t Set, size_t Way) const {
+    uint8_t* Base = static_cast<uint8_t*>(Map) + sizeof(Header);
+    return reinterpret_cast<Slot*>(Base + (Set * Ways + Way) * SlotSize);
+}
+
+ResponseCache::Slot* ResponseCache::Find(Key const& K) const {
+    uint64_t Set = K.A % Head->SetCount;
+    for (size_t Way = 0; Way < Ways; ++Way) {
+        Slot* Entry = SlotAt(Set, Way);
+        if (Entry->A == K.A && Entry->B == K.B) return Entry;
+    }
+    return nullptr;
+}
+
+std::optional<std::string> ResponseCache::Get(Key const& K) {
+    std::lock_guard<std::mutex> Guard(Mutex);
+    Lock(LOCK_SH);
+
+    std::optional<std::string> Res;
+    // A size no slot could hold means the file was damaged, so the slot counts as empty
+    Slot* Entry = Find(K);
+    if (Entry && Entry->Size <= MaxValueSize) {
+        Res.emplace(reinterpret_cast<const char*>(Entry + 1), Entry->Size);
+
+        // Other readers may stamp it at the same time, either stamp will do
+        Entry->LastUsed.store(Head->Clock.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    Lock(LOCK_UN);
+    return Res;
+}
+
+bool ResponseCache::Put(Key const& K, std::string_view Value) {
+    if (Value.size() > MaxValueSize) return false;
+
+    std::lock_guard<std::mutex> Guard(Mutex);
+    Lock(LOCK_EX);
+
+    // The same key again, else an empty slot, else the least recently used
+    Slot* Entry = Find(K);
+    if (!Entry) {
+        uint64_t Set = K.A % Head->SetCount;
+        for (size_t Way = 0; Way < Ways; ++Way) {
+            Slot* Candidate = SlotAt(Set, Way);
+            if (!Entry || Candidate->A == 0 || Candidate->LastUsed.load(std::memory_order_relaxed) < Entry->LastUsed.load(std::memory_order_relaxed)) {
+                Entry = Candidate;
+            }
+            if (Candidate->A == 0) break;
+        }
+    }
+
+    // The key goes in last, so a process dying part way leaves an empty slot
+    Entry->A = 0;
+    Entry->B = 0;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    std::memcpy(reinterpret_cast<char*>(Entry + 1), Value.data(), Value.size());
+    Entry->Size = Value.size();
+    Entry->LastUsed.store(Head->Clock.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    Entry->B = K.B;
+    Entry->A = K.A;
+
+    Lock(LOCK_UN);
+    return true;
+}
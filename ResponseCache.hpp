@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Completed responses kept on disk between runs, in a fixed size file that
+// every process maps. Entries live in sets chosen by their key; a full set
+// drops its least recently used entry, so the file never grows. Values too
+// large for a slot are not kept. Safe to use from any thread of any process.
+class ResponseCache {
+public:
+    // The first 128 bits of the request's SHA-256
+    struct Key {
+        uint64_t A = 0;
+        uint64_t B = 0;
+    };
+
+    static Key KeyOf(std::string_view Request);
+
+    // Opens the table at Path, or creates one of about Bytes. An existing
+    // table keeps its size. Null if the file cannot be created or mapped.
+    static std::shared_ptr<ResponseCache> Open(std::string const& Path, size_t Bytes);
+
+    ~ResponseCache();
+
+    ResponseCache(ResponseCache const&) = delete;
+    ResponseCache& operator=(ResponseCache const&) = delete;
+
+    std::optional<std::string> Get(Key const& K);
+
+    // False if Value is larger than a slot
+    bool Put(Key const& K, std::string_view Value);
+
+private:
+    static constexpr uint64_t Magic = 0x32484341434552ull;
+    static constexpr size_t SlotSize = 1024;
+    static constexpr size_t Ways = 8;
+
+    struct Header {
+        uint64_t Magic;
+        uint64_t SetCount;
+        std::atomic<uint64_t> Clock;
+    };
+
+    // Followed by the value. A zero key marks an empty slot.
+    struct Slot {
+        uint64_t A;
+        uint64_t B;
+        std::atomic<uint64_t> LastUsed;
+        uint64_t Size;
+    };
+
+    static constexpr size_t MaxValueSize = SlotSize - sizeof(Slot);
+
+    int Fd = -1;
+    void* Map = nullptr;
+    size_t MapSize = 0;
+    Header* Head = nullptr;
+
+    // flock is held per open file, so threads of this process take turns here first
+    std::mutex Mutex;
+
+    ResponseCache() = default;
+
+    Slot* SlotAt(uint64_t Set, size_t Way) const;
+    Slot* Find(Key const& K) const;
+    void Lock(int Mode);
+};
@@ -0,0 +1,56 @@
+#include "SharedFileBacked.hpp"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Generation must be lock free to be shared between processes");
+
+std::shared_ptr<SharedFileLock> SharedFileLock::Open(std::string const& Path) {
+    int Fd = open((Path + ".shared").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (Fd < 0) return nullptr;
+
+    // A new sidecar is zero filled, which is generation 0. Growing it to the
+    // same size from several processes at once is harmless.
+    struct stat Info;
+    if (fstat(Fd, &Info) != 0 || (Info.st_size < (off_t)sizeof(Shared) && ftruncate(Fd, sizeof(Shared)) != 0)) {
+        close(Fd);
+        return nullptr;
+    }
+
+    void* Map = mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+    if (Map == MAP_FAILED) {
+        close(Fd);
+        return nullptr;
+    }
+
+    std::shared_ptr<SharedFileLock> Result(new SharedFileLock());
+    Result->Fd = Fd;
+    Result->Header = static_cast<Shared*>(Map);
+    return Result;
+}
+
+SharedFileLock::~SharedFileLock() {
+    if (Header) munmap(Header, sizeof(Shared));
+    if (Fd >= 0) close(Fd);
+}
+
+static void LockWith(int Fd, int Mode) {
+    while (flock(Fd, Mode) != 0) {
+        if (errno != EINTR) throw StreamTransferError { "Could not lock shared file\n" };
+    }
+}
+
+void SharedFileLock::LockShared() {
+    LockWith(Fd, LOCK_SH);
+}
+
+void SharedFileLock::LockExclusive() {
+    LockWith(Fd, LOCK_EX);
+}
+
+void SharedFileLock::Unlock() {
+    flock(Fd, LOCK_UN);
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "Transfer.hpp"
+
+#include <atomic>
+
+// Advisory lock and change counter for a file shared between processes. Both
+// live in a small sidecar file next to it that every process maps, so checking
+// for changes is a single atomic load with no system call.
+class SharedFileLock {
+public:
+    // Opens or creates the sidecar for Path, null if it cannot be mapped
+    static std::shared_ptr<SharedFileLock> Open(std::string const& Path);
+
+    ~SharedFileLock();
+
+    SharedFileLock(SharedFileLock const&) = delete;
+    SharedFileLock& operator=(SharedFileLock const&) = delete;
+
+    uint64_t Generation() const {
+        return Header->Generation.load(std::memory_order_acquire);
+    }
+
+    // Called by a writer while it holds the exclusive lock, after the file is replaced
+    void Bump() {
+        Header->Generation.fetch_add(1, std::memory_order_acq_rel);
+    }
+
+    // flock based, so held per SharedFileLock and released if the process dies
+    void LockShared();
+    void LockExclusive();
+    void Unlock();
+
+private:
+    struct Shared {
+        std::atomic<uint64_t> Generation;
+    };
+
+    int Fd = -1;
+    Shared* Header = nullptr;
+
+    SharedFileLock() = default;
+};
+
+// FileBacked for files that several processes read and write. Reads come from
+// a private copy that is reloaded only when another process has changed the
+// file since, which costs one atomic load to check. Writes are transactions:
+// Update takes the exclusive lock, brings the copy up to date, applies the
+// change and writes the file before anyone else can. Nothing is written on
+// destruction. Not safe to share one instance between threads.
+template<typename T>
+class SharedFileBacked {
+public:
+    const std::filesystem::path Path;
+
+    inline SharedFileBacked(std::filesystem::path const& Path)
+    : Path(Path), Lock(SharedFileLock::Open(Path.string())) {
+        if (!Lock) {
+            throw StreamTransferError { "Could not open the shared state of " + Path.string() + "\n" };
+        }
+        Refresh();
+    }
+
+    // Whether another process has written the file since it was last read
+    bool IsStale() const {
+        return Lock->Generation() != LoadedGeneration;
+    }
+
+    // Rereads the file if it is stale, returning whether it did
+    bool Refresh() {
+        if (!IsStale()) return false;
+        Lock->LockShared();
+        try {
+            Load();
+        } catch (...) {
+            Lock->Unlock();
+            throw;
+        }
+        Lock->Unlock();
+        return true;
+    }
+
+    // The current contents, reloaded first if needed
+    T const& Get() {
+        Refresh();
+        return Value;
+    }
+
+    T const& operator*() { return Get(); }
+    T const* operator->() { return &Get(); }
+
+    // Applies Func to the latest contents and writes the result, all under
+    // the exclusive lock. False if the write failed, in which case the copy
+    // is reloaded on next access.
+    template<typename FuncT>
+    bool Update(FuncT&& Func) {
+        Lock->LockExclusive();
+        try {
+            if (IsStale()) Load();
+            Func(Value);
+        } catch (...) {
+            LoadedGeneration = NotLoaded;
+            Lock->Unlock();
+            throw;
+        }
+
+        bool Ok = WriteFileJSON(Path, Value);
+        if (Ok) {
+            Lock->Bump();
+            LoadedGeneration = Lock->Generation();
+        } else {
+            LoadedGeneration = NotLoaded;
+        }
+        Lock->Unlock();
+        return Ok;
+    }
+
+    uint64_t GetGeneration() const {
+        return LoadedGeneration;
+    }
+
+private:
+    static constexpr uint64_t NotLoaded = UINT64_MAX;
+
+    std::shared_ptr<SharedFileLock> Lock;
+    T Value;
+    uint64_t LoadedGeneration = NotLoaded;
+
+    // Caller holds a lock. The generation is read first, so a write that lands
+    // after it only makes the copy look stale again.
+    void Load() {
+        uint64_t Generation = Lock->Generation();
+        if (!ReadFileJSON(Path, Value, true)) {
+            Value = T();
+        }
+        LoadedGeneration = Generation;
+    }
+};
@@ -0,0 +1,340 @@
+#include "ShmChannel.hpp"
+
+#include <climits>
+#include <thread>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Lives in the first page of the shared memory object, ahead of the ring.
+// Positions only ever grow; a position's place in the ring is it modulo the ring size.
+struct ShmChannel::Control {
+    std::atomic<uint64_t> Magic;
+    uint64_t RingSize;
+    uint32_t SingleProducer;
+    std::atomic<uint32_t> Closed;
+
+    // Reserved by senders
+    alignas(64) std::atomic<uint64_t> Head;
+
+    // Published to the receiver, always a record boundary
+    alignas(64) std::atomic<uint64_t> Committed;
+
+    // Released by the receiver
+    alignas(64) std::atomic<uint64_t> Tail;
+
+    // Futex words, bumped whenever a sleeping side has to be woken
+    alignas(64) std::atomic<uint32_t> DataSequence;
+    std::atomic<uint32_t> ReceiverWaiting;
+
+    alignas(64) std::atomic<uint32_t> SpaceSequence;
+    std::atomic<uint32_t> SendersWaiting;
+
+    // Senders waiting for an earlier reservation to be published
+    alignas(64) std::atomic<uint32_t> CommitSequence;
+    std::atomic<uint32_t> PublishersWaiting;
+};
+
+static constexpr uint64_t ChannelMagic = 0x4C4E4843534D4853; // "SHMSCHNL"
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Ring positions must be lock free to be shared between processes");
+
+static size_t PageSize() {
+    return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+static std::string ObjectName(std::string const& Name) {
+    return Name.starts_with("/") ? Name : "/" + Name;
+}
+
+static void FutexWait(std::atomic<uint32_t>& Word, uint32_t Expected) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&Word), FUTEX_WAIT, Expected, nullptr, nullptr, 0);
+}
+
+static void FutexWake(std::atomic<uint32_t>& Word, int Count) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&Word), FUTEX_WAKE, Count, nullptr, nullptr, 0);
+}
+
+static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+uint32_t ShmChannel::DefaultSpinIterations() {
+    return std::thread::hardware_concurrency() > 1 ? 4096 : 0;
+}
+
+std::shared_ptr<ShmChannel> ShmChannel::Map(int Fd, size_t RingSize) {
+    size_t ControlSize = PageSize();
+
+    // Reserve room for the control page and two copies of the ring, then map
+    // the ring's pages again right after the first copy
+    size_t Total = ControlSize + 2 * RingSize;
+    void* Base = mmap(nullptr, Total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Base == MAP_FAILED) return nullptr;
+
+    uint8_t* Bytes = static_cast<uint8_t*>(Base);
+    if (mmap(Bytes, ControlSize + RingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, Fd, 0) == MAP_FAILED
+        || mmap(Bytes + ControlSize + RingSize, RingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, Fd, static_cast<off_t>(ControlSize)) == MAP_FAILED) {
+        munmap(Base, Total);
+        return nullptr;
+    }
+
+    std::shared_ptr<ShmChannel> Res(new ShmChannel());
+    Res->Shared = reinterpret_cast<Control*>(Bytes);
+    Res->Ring = Bytes + ControlSize;
+    Res->RingSize = RingSize;
+    Res->MappedSize = Total;
+    return Res;
+}
+
+std::shared_ptr<ShmChannel> ShmChannel::Create(std::string const& Name, Options Opts) {
+    static_assert(sizeof(Control) <= 4096, "Control must fit in a page");
+
+    size_t RingSize = PageSize();
+    while (RingSize < Opts.Capacity) RingSize *= 2;
+
+    std::string Object = ObjectName(Name);
+    shm_unlink(Object.c_str());
+    int Fd = shm_open(Object.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (Fd < 0) return nullptr;
+
+    std::shared_ptr<ShmChannel> Res;
+    if (ftruncate(Fd, static_cast<off_t>(PageSize() + RingSize)) == 0) {
+        Res = Map(Fd, RingSize);
+    }
+    close(Fd);
+    if (!Res) {
+        shm_unlink(Object.c_str());
+        return nullptr;
+    }
+
+    // The object starts zeroed, so only the fixed fields need setting. The
+    // magic goes last so Open never sees a half made channel.
+    Res->Shared->RingSize = RingSize;
+    Res->Shared->SingleProducer = Opts.SingleProducer;
+    Res->Shared->Magic.store(ChannelMagic, std::memory_order_release);
+    return Res;
+}
+
+std::shared_ptr<ShmChannel> ShmChannel::Open(std::string const& Name) {
+    int Fd = shm_open(ObjectName(Name).c_str(), O_RDWR | O_CLOEXEC, 0);
+    if (Fd < 0) return nullptr;
+
+    // Learn the ring size from the control page before mapping the rest
+    std::shared_ptr<ShmChannel> Res;
+    struct stat Info;
+    if (fstat(Fd, &Info) == 0 && static_cast<size_t>(Info.st_size) > PageSize()) {
+        void* Page = mmap(nullptr, PageSize(), PROT_READ, MAP_SHARED, Fd, 0);
+        if (Page != MAP_FAILED) {
+            Control const* Header = static_cast<Control const*>(Page);
+            size_t RingSize = Header->RingSize;
+            bool Valid = Header->Magic.load(std::memory_order_acquire) == ChannelMagic
+                && RingSize != 0 && PageSize() + RingSize == static_cast<size_t>(Info.st_size);
+            munmap(Page, PageSize());
+            if (Valid) Res = Map(Fd, RingSize);
+        }
+    }
+    close(Fd);
+    return Res;
+}
+
+bool ShmChannel::Unlink(std::string const& Name) {
+    return shm_unlink(ObjectName(Name).c_str()) == 0;
+}
+
+ShmChannel::~ShmChannel() {
+    if (Shared) munmap(Shared, MappedSize);
+}
+
+void ShmChannel::Close() {
+    Shared->Closed.store(1, std::memory_order_seq_cst);
+    Shared->DataSequence.fetch_add(1, std::memory_order_seq_cst);
+    Shared->SpaceSequence.fetch_add(1, std::memory_order_seq_cst);
+    Shared->CommitSequence.fetch_add(1, std::memory_order_seq_cst);
+    FutexWake(Shared->DataSequence, INT_MAX);
+    FutexWake(Shared->SpaceSequence, INT_MAX);
+    FutexWake(Shared->CommitSequence, INT_MAX);
+}
+
+bool ShmChannel::Reserve(uint64_t Need, uint64_t& At) {
+    uint32_t Spins = 0;
+    while (true) {
+        if (Shared->Closed.load(std::memory_order_acquire)) return false;
+
+        uint64_t Head = Shared->Head.load(std::memory_order_relaxed);
+        uint64_t Room = Shared->Tail.load(std::memory_order_acquire) + RingSize;
+        if (Head + Need <= Room) {
+            if (Shared->SingleProducer) {
+                Shared->Head.store(Head + Need, std::memory_order_relaxed);
+                At = Head;
+                return true;
+            }
+            if (Shared->Head.compare_exchange_weak(Head, Head + Need, std::memory_order_relaxed)) {
+                At = Head;
+                return true;
+            }
+            continue;
+        }
+
+        if (Spins++ < SpinIterations) {
+            CpuRelax();
+            continue;
+        }
+
+        // Announce before rechecking, so a receiver freeing space in between sees us
+        uint32_t Sequence = Shared->SpaceSequence.load(std::memory_order_seq_cst);
+        Shared->SendersWaiting.fetch_add(1, std::memory_order_seq_cst);
+        if (Head + Need > Shared->Tail.load(std::memory_order_seq_cst) + RingSize && !Shared->Closed.load(std::memory_order_seq_cst)) {
+            FutexWait(Shared->SpaceSequence, Sequence);
+        }
+        Shared->SendersWaiting.fetch_sub(1, std::memory_order_seq_cst);
+        Spins = 0;
+    }
+}
+
+bool ShmChannel::Publish(uint64_t At, uint64_t Need) {
+    // Records are handed over in the order they were reserved, so wait for
+    // senders that reserved earlier to finish filling theirs. One that died
+    // in between never publishes; only closing the channel ends the wait.
+    uint32_t Spins = 0;
+    while (Shared->Committed.load(std::memory_order_acquire) != At) {
+        if (Shared->Closed.load(std::memory_order_acquire)) return false;
+
+        if (Spins++ < SpinIterations) {
+            CpuRelax();
+            continue;
+        }
+
+        // Announce before rechecking, so a sender publishing in between sees us
+        uint32_t Sequence = Shared->CommitSequence.load(std::memory_order_seq_cst);
+        Shared->PublishersWaiting.fetch_add(1, std::memory_order_seq_cst);
+        if (Shared->Committed.load(std::memory_order_seq_cst) != At && !Shared->Closed.load(std::memory_order_seq_cst)) {
+            FutexWait(Shared->CommitSequence, Sequence);
+        }
+        Shared->PublishersWaiting.fetch_sub(1, std::memory_order_seq_cst);
+        Spins = 0;
+    }
+
+    Shared->Committed.store(At + Need, std::memory_order_seq_cst);
+    if (Shared->ReceiverWaiting.load(std::memory_order_seq_cst)) {
+        Shared->DataSequence.fetch_add(1, std::memory_order_seq_cst);
+        FutexWake(Shared->DataSequence, 1);
+    }
+    // Only the next in line can go on, but which waiter that is is not known
+    if (Shared->PublishersWaiting.load(std::memory_order_seq_cst)) {
+        Shared->CommitSequence.fetch_add(1, std::memory_order_seq_cst);
+        FutexWake(Shared->CommitSequence, INT_MAX);
+    }
+    return true;
+}
+
+bool ShmChannel::SendCb(std::function<void(JSONSerializer&)> const& Func, size_t HeaderSizeHint) {
+    TransferPool<JSONSerializer>::Handle Ser = TransferPool<JSONSerializer>::Acquire();
+
+    Func(*Ser);
+    FinishText(*Ser, HeaderSizeHint);
+
+    uint64_t Need = AlignUp(sizeof(Record) + Ser->Text.size() + Ser->BinarySize(), RecordAlignment);
+    if (Need > RingSize) return false;
+
+    uint64_t At;
+    if (!Reserve(Need, At)) return false;
+
+    // Contiguous even across the end of the ring thanks to the second mapping
+    uint8_t* Out = Ring + (At & (RingSize - 1));
+    Record* Header = reinterpret_cast<Record*>(Out);
+    Out += sizeof(Record);
+
+    memcpy(Out, Ser->Text.data(), Ser->Text.size());
+    Out += Ser->Text.size();
+
+    bool Ok = true;
+    size_t Copied = 0;
+    for (ExternalRange const& Range : Ser->External) {
+        memcpy(Out, Ser->Binary.data() + Copied, Range.At - Copied);
+        Out += Range.At - Copied;
+        Copied = Range.At;
+
+        Ok = Ok && Range.File && Range.File->ReadAt(Range.Offset, std::span<uint8_t>(Out, Range.Length));
+        Out += Range.Length;
+    }
+    memcpy(Out, Ser->Binary.data() + Copied, Ser->Binary.size() - Copied);
+
+    // The space is claimed either way, so a failed record is still published for the receiver to skip
+    Header->Size = Need;
+    Header->TextSize = Ok ? Ser->Text.size() : 0;
+    return Publish(At, Need) && Ok;
+}
+
+bool ShmChannel::Take(std::function<void(IndexedDeserializer&)> const& Func, bool Wait) {
+    while (true) {
+        uint64_t Tail = Shared->Tail.load(std::memory_order_relaxed);
+
+        uint32_t Spins = 0;
+        while (Shared->Committed.load(std::memory_order_acquire) == Tail) {
+            if (!Wait || Shared->Closed.load(std::memory_order_acquire)) {
+                // Recheck, a record may have been published just before closing
+                if (Shared->Committed.load(std::memory_order_acquire) == Tail) return false;
+                break;
+            }
+
+            if (Spins++ < SpinIterations) {
+                CpuRelax();
+                continue;
+            }
+
+            uint32_t Sequence = Shared->DataSequence.load(std::memory_order_seq_cst);
+            Shared->ReceiverWaiting.store(1, std::memory_order_seq_cst);
+            if (Shared->Committed.load(std::memory_order_seq_cst) == Tail && !Shared->Closed.load(std::memory_order_seq_cst)) {
+                FutexWait(Shared->DataSequence, Sequence);
+            }
+            Shared->ReceiverWaiting.store(0, std::memory_order_relaxed);
+            Spins = 0;
+        }
+
+        Record const* Header = reinterpret_cast<Record const*>(Ring + (Tail & (RingSize - 1)));
+        uint64_t Size = Header->Size;
+        uint64_t TextSize = Header->TextSize;
+
+        // Frees the record for senders, waking any that ran out of room
+        auto Release = [this, Tail, Size]() {
+            Shared->Tail.store(Tail + Size, std::memory_order_seq_cst);
+            if (Shared->SendersWaiting.load(std::memory_order_seq_cst)) {
+                Shared->SpaceSequence.fetch_add(1, std::memory_order_seq_cst);
+                FutexWake(Shared->SpaceSequence, INT_MAX);
+            }
+        };
+
+        if (TextSize == 0) {
+            Release();
+            continue;
+        }
+
+        const uint8_t* Text = reinterpret_cast<const uint8_t*>(Header + 1);
+        try {
+            TransferPool<IndexedDeserializer>::Handle Deser = TransferPool<IndexedDeserializer>::Acquire();
+            Deser->MappedBinary = std::span<const uint8_t>(Text + TextSize, Size - sizeof(Record) - TextSize);
+            Deser->Load(std::string_view(reinterpret_cast<const char*>(Text), TextSize - 1));
+            Func(*Deser);
+        } catch (...) {
+            Release();
+            throw;
+        }
+        Release();
+        return true;
+    }
+}
+
+bool ShmChannel::ReceiveCb(std::function<void(IndexedDeserializer&)> const& Func) {
+    return Take(Func, true);
+}
+
+bool ShmChannel::TryReceiveCb(std::function<void(IndexedDeserializer&)> const& Func) {
+    return Take(Func, false);
+}
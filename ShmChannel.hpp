@@ -0,0 +1,109 @@
+#pragma once
+
+#include "Transfer.hpp"
+
+#include <atomic>
+
+// Message channel between processes on one machine through a ring buffer in
+// POSIX shared memory. Any number of processes may send, one receives. Each
+// message is a record holding the same bytes WriteFileJSON writes, serialized
+// straight into the ring. The ring is mapped twice back to back, so a record
+// that wraps is still contiguous and the receiver decodes it where it lies.
+// Sending and receiving take no locks and no system calls while the other
+// side keeps up; a side that has to wait spins briefly, then sleeps on a futex.
+class ShmChannel {
+public:
+    struct Options {
+        // Rounded up to a power of two of at least a page. Bounds the largest message.
+        size_t Capacity = 4 * 1024 * 1024;
+
+        // Lets the sender skip the atomic reservation when only one process sends
+        bool SingleProducer = false;
+    };
+
+    // How long a waiting side polls before sleeping on the futex. None on a
+    // single core, where polling only delays the side being waited for.
+    uint32_t SpinIterations = DefaultSpinIterations();
+
+    static uint32_t DefaultSpinIterations();
+
+    // Creates the shared memory object Name, replacing any stale one. Null on failure.
+    static std::shared_ptr<ShmChannel> Create(std::string const& Name, Options Opts);
+    static std::shared_ptr<ShmChannel> Create(std::string const& Name) { return Create(Name, Options()); }
+
+    // Attaches to a channel another process created, null if there is none
+    static std::shared_ptr<ShmChannel> Open(std::string const& Name);
+
+    // Removes the name; mapped channels keep working until closed
+    static bool Unlink(std::string const& Name);
+
+    ~ShmChannel();
+
+    ShmChannel(ShmChannel const&) = delete;
+    ShmChannel& operator=(ShmChannel const&) = delete;
+
+    // Waits for room if the ring is full, then for senders that reserved room
+    // earlier to publish their messages. A sender that dies or stalls while
+    // filling its message holds up every later one until the channel is
+    // closed. False if the channel is closed, the message is larger than the
+    // ring, or a file range could not be read.
+    bool SendCb(std::function<void(JSONSerializer&)> const& Func, size_t HeaderSizeHint = 0);
+
+    // Waits for the next message and hands it to Func, decoded in place in
+    // the ring. False once the channel is closed and drained. Only one thread
+    // in one process may receive.
+    bool ReceiveCb(std::function<void(IndexedDeserializer&)> const& Func);
+
+    // As ReceiveCb, but false at once if no message is waiting
+    bool TryReceiveCb(std::function<void(IndexedDeserializer&)> const& Func);
+
+    // Wakes every waiting side in every process; later sends fail and
+    // receives fail once the ring is drained
+    void Close();
+
+    size_t Capacity() const { return RingSize; }
+
+    template<typename T>
+    bool Send(T const& Value) {
+        SizeSerializer Sizer = EncodedSize(Value);
+        return SendCb([&Value, &Sizer](JSONSerializer& Ser) {
+            Ser.Binary.reserve(Sizer.BinarySize - Sizer.ExternalSize);
+            Value.Send(Ser);
+        }, Sizer.HeaderSize());
+    }
+
+    // With InPlace, Value is decoded into rather than rebuilt, see JSONDeserializer::InPlace
+    template<typename T>
+    bool Receive(T& Value, bool InPlace = false) {
+        return ReceiveCb([&Value, InPlace](IndexedDeserializer& Deser) {
+            Deser.InPlace = InPlace;
+            Value.Receive(Deser);
+        });
+    }
+
+private:
+    struct Control;
+
+    struct Record {
+        // Bytes up to the next record, header included
+        uint64_t Size;
+        // Zero marks a record that failed to fill and is skipped
+        uint64_t TextSize;
+    };
+
+    static constexpr size_t RecordAlignment = sizeof(Record);
+
+    Control* Shared = nullptr;
+    uint8_t* Ring = nullptr;
+    size_t RingSize = 0;
+    size_t MappedSize = 0;
+
+    ShmChannel() = default;
+
+    static std::shared_ptr<ShmChannel> Map(int Fd, size_t RingSize);
+
+    bool Reserve(uint64_t Need, uint64_t& At);
+    // False if the channel was closed while waiting for earlier senders
+    bool Publish(uint64_t At, uint64_t Need);
+    bool Take(std::function<void(IndexedDeserializer&)> const& Func, bool Wait);
+};
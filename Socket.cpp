@@ -0,0 +1,256 @@
+#include "Socket.hpp"
+
+#include <cerrno>
+#include <climits>
+#include <csignal>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Sends every byte of Parts, advancing through them as partial writes land
+static bool SendAll(int Fd, std::vector<iovec>& Parts) {
+    size_t First = 0;
+    while (First < Parts.size()) {
+        msghdr Message = { };
+        Message.msg_iov = Parts.data() + First;
+        Message.msg_iovlen = std::min<size_t>(Parts.size() - First, IOV_MAX);
+
+        ssize_t Count = sendmsg(Fd, &Message, MSG_NOSIGNAL);
+        if (Count < 0 && errno == EINTR) continue;
+        if (Count <= 0) return false;
+
+        size_t Left = static_cast<size_t>(Count);
+        while (First < Parts.size() && Left >= Parts[First].iov_len) {
+            Left -= Parts[First].iov_len;
+            ++First;
+        }
+        if (Left != 0) {
+            Parts[First].iov_base = static_cast<uint8_t*>(Parts[First].iov_base) + Left;
+            Parts[First].iov_len -= Left;
+        }
+    }
+    Parts.clear();
+    return true;
+}
+
+// sendfile takes no MSG_NOSIGNAL, so while a file range goes out SIGPIPE is
+// blocked on this thread, and one raised by a peer that hung up is discarded
+// before it is unblocked. The write then just fails with EPIPE.
+class SigPipeBlock {
+public:
+    SigPipeBlock() {
+        sigemptyset(&Pipe);
+        sigaddset(&Pipe, SIGPIPE);
+
+        // One already pending was not ours to discard
+        sigset_t Pending;
+        sigpending(&Pending);
+        WasPending = sigismember(&Pending, SIGPIPE) == 1;
+        pthread_sigmask(SIG_BLOCK, &Pipe, &Old);
+    }
+
+    ~SigPipeBlock() {
+        if (!WasPending) {
+            timespec Zero = { };
+            while (sigtimedwait(&Pipe, nullptr, &Zero) < 0 && errno == EINTR) { }
+        }
+        pthread_sigmask(SIG_SETMASK, &Old, nullptr);
+    }
+
+    SigPipeBlock(SigPipeBlock const&) = delete;
+    SigPipeBlock& operator=(SigPipeBlock const&) = delete;
+
+private:
+    sigset_t Pipe;
+    sigset_t Old;
+    bool WasPending;
+};
+
+// False if the connection ended or failed before Size bytes arrived
+static bool ReceiveAll(int Fd, uint8_t* Data, size_t Size) {
+    while (Size != 0) {
+        ssize_t Count = recv(Fd, Data, Size, MSG_WAITALL);
+        if (Count < 0 && errno == EINTR) continue;
+        if (Count <= 0) return false;
+        Data += Count;
+        Size -= static_cast<size_t>(Count);
+    }
+    return true;
+}
+
+std::shared_ptr<SocketChannel> SocketChannel::Adopt(int Fd) {
+    if (Fd < 0) return nullptr;
+    return std::shared_ptr<SocketChannel>(new SocketChannel(Fd));
+}
+
+std::shared_ptr<SocketChannel> SocketChannel::ConnectUnix(std::string const& Path) {
+    sockaddr_un Address = { };
+    Address.sun_family = AF_UNIX;
+    if (Path.size() >= sizeof(Address.sun_path)) return nullptr;
+    memcpy(Address.sun_path, Path.c_str(), Path.size() + 1);
+
+    int Fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (Fd < 0) return nullptr;
+    if (connect(Fd, reinterpret_cast<sockaddr*>(&Address), sizeof(Address)) != 0) {
+        close(Fd);
+        return nullptr;
+    }
+    return Adopt(Fd);
+}
+
+// Frames are written whole, so waiting to coalesce small writes only adds latency
+static void DisableNagle(int Fd) {
+    int On = 1;
+    setsockopt(Fd, IPPROTO_TCP, TCP_NODELAY, &On, sizeof(On));
+}
+
+std::shared_ptr<SocketChannel> SocketChannel::ConnectTCP(std::string const& Host, uint16_t Port) {
+    addrinfo Hints = { };
+    Hints.ai_family = AF_UNSPEC;
+    Hints.ai_socktype = SOCK_STREAM;
+    addrinfo* Found = nullptr;
+    if (getaddrinfo(Host.c_str(), std::to_string(Port).c_str(), &Hints, &Found) != 0) return nullptr;
+
+    int Fd = -1;
+    for (addrinfo* Candidate = Found; Candidate; Candidate = Candidate->ai_next) {
+        Fd = socket(Candidate->ai_family, Candidate->ai_socktype | SOCK_CLOEXEC, Candidate->ai_protocol);
+        if (Fd < 0) continue;
+        if (connect(Fd, Candidate->ai_addr, Candidate->ai_addrlen) == 0) break;
+        close(Fd);
+        Fd = -1;
+    }
+    freeaddrinfo(Found);
+
+    if (Fd < 0) return nullptr;
+    DisableNagle(Fd);
+    return Adopt(Fd);
+}
+
+SocketChannel::~SocketChannel() {
+    if (Fd >= 0) close(Fd);
+}
+
+bool SocketChannel::SendCb(std::function<void(JSONSerializer&)> const& Func, size_t HeaderSizeHint) {
+    TransferPool<JSONSerializer>::Handle Ser = TransferPool<JSONSerializer>::Acquire();
+
+    Func(*Ser);
+    FinishText(*Ser, HeaderSizeHint);
+
+    FrameHeader Header = { FrameMagic, 0, Ser->Text.size(), Ser->BinarySize() };
+
+    std::vector<iovec> Parts;
+    Parts.reserve(3 + Ser->External.size());
+    auto Add = [&Parts](const void* Data, size_t Size) {
+        if (Size != 0) Parts.push_back(iovec { const_cast<void*>(Data), Size });
+    };
+    Add(&Header, sizeof(Header));
+    Add(Ser->Text.data(), Ser->Text.size());
+
+    // Everything up to each file range goes out in one gathered write, then
+    // the range itself is sent from the file by the kernel
+    size_t Sent = 0;
+    for (ExternalRange const& Range : Ser->External) {
+        Add(Ser->Binary.data() + Sent, Range.At - Sent);
+        Sent = Range.At;
+        if (!SendAll(Fd, Parts)) return false;
+
+        SigPipeBlock Blocked;
+        if (!Range.File || !CopyRange(Fd, Range)) return false;
+    }
+    Add(Ser->Binary.data() + Sent, Ser->Binary.size() - Sent);
+    return SendAll(Fd, Parts);
+}
+
+bool SocketChannel::ReceiveCb(std::function<void(IndexedDeserializer&)> const& Func) {
+    FrameHeader Header;
+    if (!ReceiveAll(Fd, reinterpret_cast<uint8_t*>(&Header), sizeof(Header))) return false;
+    if (Header.Magic != FrameMagic || Header.TextSize == 0
+        || Header.TextSize > MaxFrameBytes || Header.BinarySize > MaxFrameBytes - Header.TextSize) {
+        return false;
+    }
+
+    TransferPool<IndexedDeserializer>::Handle Deser = TransferPool<IndexedDeserializer>::Acquire();
+
+    // The frame lands in the deserializer's buffer and is decoded where it lies
+    std::vector<uint8_t>& Contents = Deser->Contents;
+    Contents.resize(Header.TextSize + Header.BinarySize);
+    if (!ReceiveAll(Fd, Contents.data(), Contents.size())) return false;
+    if (Contents[Header.TextSize - 1] != 0) return false;
+
+    Deser->BinaryBegin = Header.TextSize;
+    Deser->Load(std::string_view(reinterpret_cast<const char*>(Contents.data()), Header.TextSize - 1));
+
+    Func(*Deser);
+
+    return true;
+}
+
+std::shared_ptr<SocketListener> SocketListener::ListenUnix(std::string const& Path) {
+    sockaddr_un Address = { };
+    Address.sun_family = AF_UNIX;
+    if (Path.size() >= sizeof(Address.sun_path)) return nullptr;
+    memcpy(Address.sun_path, Path.c_str(), Path.size() + 1);
+
+    int Fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (Fd < 0) return nullptr;
+
+    unlink(Path.c_str());
+    if (bind(Fd, reinterpret_cast<sockaddr*>(&Address), sizeof(Address)) != 0 || listen(Fd, SOMAXCONN) != 0) {
+        close(Fd);
+        return nullptr;
+    }
+    return std::shared_ptr<SocketListener>(new SocketListener(Fd, false, Path));
+}
+
+std::shared_ptr<SocketListener> SocketListener::ListenTCP(uint16_t Port, std::string const& Host) {
+    addrinfo Hints = { };
+    Hints.ai_family = AF_UNSPEC;
+    Hints.ai_socktype = SOCK_STREAM;
+    Hints.ai_flags = AI_PASSIVE;
+    addrinfo* Found = nullptr;
+    if (getaddrinfo(Host.empty() ? nullptr : Host.c_str(), std::to_string(Port).c_str(), &Hints, &Found) != 0) return nullptr;
+
+    int Fd = -1;
+    for (addrinfo* Candidate = Found; Candidate; Candidate = Candidate->ai_next) {
+        Fd = socket(Candidate->ai_family, Candidate->ai_socktype | SOCK_CLOEXEC, Candidate->ai_protocol);
+        if (Fd < 0) continue;
+        int On = 1;
+        setsockopt(Fd, SOL_SOCKET, SO_REUSEADDR, &On, sizeof(On));
+        if (bind(Fd, Candidate->ai_addr, Candidate->ai_addrlen) == 0 && listen(Fd, SOMAXCONN) == 0) break;
+        close(Fd);
+        Fd = -1;
+    }
+    freeaddrinfo(Found);
+
+    if (Fd < 0) return nullptr;
+    return std::shared_ptr<SocketListener>(new SocketListener(Fd, true, ""));
+}
+
+SocketListener::~SocketListener() {
+    if (Fd >= 0) close(Fd);
+    if (!UnixPath.empty()) unlink(UnixPath.c_str());
+}
+
+std::shared_ptr<SocketChannel> SocketListener::Accept() {
+    while (true) {
+        int Client = accept4(Fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (Client < 0 && errno == EINTR) continue;
+        if (Client < 0) return nullptr;
+        if (TCP) DisableNagle(Client);
+        return SocketChannel::Adopt(Client);
+    }
+}
+
+uint16_t SocketListener::GetPort() const {
+    sockaddr_storage Address = { };
+    socklen_t Size = sizeof(Address);
+    if (!TCP || getsockname(Fd, reinterpret_cast<sockaddr*>(&Address), &Size) != 0) return 0;
+    if (Address.ss_family == AF_INET6) return ntohs(reinterpret_cast<sockaddr_in6*>(&Address)->sin6_port);
+    return ntohs(reinterpret_cast<sockaddr_in*>(&Address)->sin_port);
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "Transfer.hpp"
+
+// A connected Unix or TCP stream socket that carries Transfer values as
+// frames. Each frame is a FrameHeader followed by exactly what WriteFileJSON
+// would write: the null terminated text, then the binary section. Sending
+// gathers the header, text and in-memory binary into one sendmsg, and file
+// ranges are streamed with sendfile, so the message is never assembled in one
+// buffer. Receiving reads the frame into the deserializer's own buffer and
+// decodes from there. One thread may send while another receives.
+class SocketChannel {
+public:
+    struct FrameHeader {
+        uint32_t Magic;
+        uint32_t Reserved;
+        // Including the null terminator and alignment padding
+        uint64_t TextSize;
+        uint64_t BinarySize;
+    };
+
+    static constexpr uint32_t FrameMagic = 0x53465254; // "TRFS"
+
+    // Frames claiming to be larger than this are treated as a broken connection.
+    // Each frame is allocated whole before it is read, so a peer can make this
+    // much memory be allocated; raise it only for peers that need it.
+    uint64_t MaxFrameBytes = 64ull << 20;
+
+    // Takes ownership of an already connected socket
+    static std::shared_ptr<SocketChannel> Adopt(int Fd);
+
+    // Null if the connection could not be made
+    static std::shared_ptr<SocketChannel> ConnectUnix(std::string const& Path);
+    static std::shared_ptr<SocketChannel> ConnectTCP(std::string const& Host, uint16_t Port);
+
+    ~SocketChannel();
+
+    SocketChannel(SocketChannel const&) = delete;
+    SocketChannel& operator=(SocketChannel const&) = delete;
+
+    int Descriptor() const { return Fd; }
+
+    // False if the connection failed part way, in which case it is unusable
+    bool SendCb(std::function<void(JSONSerializer&)> const& Func, size_t HeaderSizeHint = 0);
+
+    // Waits for the next frame and hands it to Func. False once the peer has
+    // closed the connection or it failed; decoding errors throw as usual.
+    bool ReceiveCb(std::function<void(IndexedDeserializer&)> const& Func);
+
+    template<typename T>
+    bool Send(T const& Value) {
+        SizeSerializer Sizer = EncodedSize(Value);
+        return SendCb([&Value, &Sizer](JSONSerializer& Ser) {
+            Ser.Binary.reserve(Sizer.BinarySize - Sizer.ExternalSize);
+            Value.Send(Ser);
+        }, Sizer.HeaderSize());
+    }
+
+    // With InPlace, Value is decoded into rather than rebuilt, see JSONDeserializer::InPlace
+    template<typename T>
+    bool Receive(T& Value, bool InPlace = false) {
+        return ReceiveCb([&Value, InPlace](IndexedDeserializer& Deser) {
+            Deser.InPlace = InPlace;
+            Value.Receive(Deser);
+        });
+    }
+
+private:
+    int Fd = -1;
+
+    SocketChannel(int Fd) : Fd(Fd) { }
+};
+
+class SocketListener {
+public:
+    // Replaces a stale socket file at Path. Null if it could not be bound.
+    static std::shared_ptr<SocketListener> ListenUnix(std::string const& Path);
+
+    // Port 0 picks a free port, see GetPort. Only this machine can connect by
+    // default; Host empty means all interfaces.
+    static std::shared_ptr<SocketListener> ListenTCP(uint16_t Port, std::string const& Host = "127.0.0.1");
+
+    ~SocketListener();
+
+    SocketListener(SocketListener const&) = delete;
+    SocketListener& operator=(SocketListener const&) = delete;
+
+    // Waits for the next connection, null if accepting failed
+    std::shared_ptr<SocketChannel> Accept();
+
+    uint16_t GetPort() const;
+
+    int Descriptor() const { return Fd; }
+
+private:
+    int Fd = -1;
+    bool TCP = false;
+
+    // Unlinked again when the listener closes
+    std::string UnixPath;
+
+    SocketListener(int Fd, bool TCP, std::string UnixPath)
+    : Fd(Fd), TCP(TCP), UnixPath(std::move(UnixPath)) { }
+};
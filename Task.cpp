@@ -0,0 +1,75 @@
+#include "Task.hpp"
+
+#include <iostream>
+
+static thread_local Executor* CurrentExecutor = nullptr;
+
+Executor::Executor(size_t Count) {
+    Threads.reserve(Count);
+    for (size_t i = 0; i < Count; ++i) {
+        Threads.emplace_back([this]() {
+            Run();
+        });
+    }
+}
+
+Executor::~Executor() {
+    {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        Stopping = true;
+    }
+    Ready.notify_all();
+    for (std::thread& Thread : Threads) {
+        Thread.join();
+    }
+}
+
+void Executor::Post(std::coroutine_handle<> Handle) {
+    {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        Queue.push_back(Handle);
+    }
+    Ready.notify_one();
+}
+
+void Executor::Run() {
+    CurrentExecutor = this;
+    while (true) {
+        std::coroutine_handle<> Next;
+        {
+            std::unique_lock<std::mutex> Lock(Mutex);
+            Ready.wait(Lock, [this]() {
+                return Stopping || !Queue.empty();
+            });
+            if (Stopping) break;
+            Next = Queue.front();
+            Queue.pop_front();
+        }
+        Next.resume();
+    }
+    CurrentExecutor = nullptr;
+}
+
+Executor* Executor::Current() {
+    return CurrentExecutor;
+}
+
+Executor& Executor::Default() {
+    static Executor* Instance = new Executor(std::max(1u, std::thread::hardware_concurrency()));
+    return *Instance;
+}
+
+static TaskDetail::Detached RunSpawned(Executor& Exec, Task<void> Work) {
+    co_await Exec.Schedule();
+    try {
+        co_await std::move(Work);
+    } catch (std::exception const& Err) {
+        std::cerr << "Spawned task failed: " << Err.what() << "\n";
+    } catch (...) {
+        std::cerr << "Spawned task failed\n";
+    }
+}
+
+void Executor::Spawn(Task<void> Work) {
+    RunSpawned(*this, std::move(Work));
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+template<typename T>
+class Task;
+
+namespace TaskDetail {
+
+template<typename T>
+struct Result {
+    std::optional<T> Value;
+
+    template<typename U>
+    void return_value(U&& Val) {
+        Value.emplace(std::forward<U>(Val));
+    }
+
+    T Take() {
+        return std::move(*Value);
+    }
+};
+
+template<>
+struct Result<void> {
+    void return_void() { }
+    void Take() { }
+};
+
+}
+
+// Lazily started coroutine producing a T. Awaiting it runs it, and the awaiter
+// resumes straight from its end without going through a queue. Run top level
+// tasks with Executor::Spawn or SyncWait.
+template<typename T = void>
+class Task {
+public:
+    struct promise_type : TaskDetail::Result<T> {
+        std::coroutine_handle<> Continuation;
+        std::exception_ptr Error;
+
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept { return { }; }
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> Handle) noexcept {
+                std::coroutine_handle<> Next = Handle.promise().Continuation;
+                return Next ? Next : std::noop_coroutine();
+            }
+
+            void await_resume() noexcept { }
+        };
+
+        FinalAwaiter final_suspend() noexcept { return { }; }
+
+        void unhandled_exception() {
+            Error = std::current_exception();
+        }
+    };
+
+    Task(Task&& Rhs) noexcept
+    : Handle(std::exchange(Rhs.Handle, nullptr)) { }
+
+    Task& operator=(Task&& Rhs) noexcept {
+        if (this != &Rhs) {
+            if (Handle) Handle.destroy();
+            Handle = std::exchange(Rhs.Handle, nullptr);
+        }
+        return *this;
+    }
+
+    ~Task() {
+        if (Handle) Handle.destroy();
+    }
+
+    struct Awaiter {
+        std::coroutine_handle<promise_type> Handle;
+
+        bool await_ready() noexcept { return Handle.done(); }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> Caller) noexcept {
+            Handle.promise().Continuation = Caller;
+            return Handle;
+        }
+
+        T await_resume() {
+            if (Handle.promise().Error) {
+                std::rethrow_exception(std::exchange(Handle.promise().Error, nullptr));
+            }
+            return Handle.promise().Take();
+        }
+    };
+
+    // Throws on a moved from Task, which has nothing to run or return
+    Awaiter operator co_await() && {
+        if (!Handle) throw std::logic_error("Awaited a Task that was moved from");
+        return Awaiter { Handle };
+    }
+
+private:
+    std::coroutine_handle<promise_type> Handle;
+
+    explicit Task(std::coroutine_handle<promise_type> Handle)
+    : Handle(Handle) { }
+};
+
+// Pool of threads that resume coroutines. Awaitables that finish elsewhere,
+// such as HTTP requests, hand the coroutine back to the executor it was
+// running on, so a few threads can host any number of waiting tasks.
+class Executor {
+public:
+    Executor(size_t Threads);
+
+    // Waits for the threads to finish what they are running. Queued work is dropped.
+    ~Executor();
+
+    Executor(Executor const&) = delete;
+    Executor& operator=(Executor const&) = delete;
+
+    void Post(std::coroutine_handle<> Handle);
+
+    // Runs Work on this executor until it finishes. Exceptions it lets escape are reported on stderr.
+    void Spawn(Task<void> Work);
+
+    // co_await Exec.Schedule() continues on one of Exec's threads
+    auto Schedule() {
+        struct Awaiter {
+            Executor& Exec;
+            bool await_ready() noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> Handle) { Exec.Post(Handle); }
+            void await_resume() noexcept { }
+        };
+        return Awaiter { *this };
+    }
+
+    // The executor running the calling thread, null outside of one
+    static Executor* Current();
+
+    // One thread per core. Never destroyed, so it outlives every static that may post to it.
+    static Executor& Default();
+
+private:
+    std::mutex Mutex;
+    std::condition_variable Ready;
+    std::deque<std::coroutine_handle<>> Queue;
+    bool Stopping = false;
+    std::vector<std::thread> Threads;
+
+    void Run();
+};
+
+// The executor to resume on after an outside event: the caller's own, or the default
+inline Executor& ResumeExecutor() {
+    Executor* Current = Executor::Current();
+    return Current ? *Current : Executor::Default();
+}
+
+namespace TaskDetail {
+
+// Frame that frees itself when done, for tasks nobody awaits
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return { }; }
+        std::suspend_never initial_suspend() noexcept { return { }; }
+        std::suspend_never final_suspend() noexcept { return { }; }
+        void return_void() { }
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// Owns the promise, since the waiter may return as soon as it is set
+template<typename T>
+Detached RunInto(Executor& Exec, Task<T> Work, std::promise<T> Promise) {
+    co_await Exec.Schedule();
+    try {
+        if constexpr (std::is_void_v<T>) {
+            co_await std::move(Work);
+            Promise.set_value();
+        } else {
+            Promise.set_value(co_await std::move(Work));
+        }
+    } catch (...) {
+        Promise.set_exception(std::current_exception());
+    }
+}
+
+}
+
+// Runs Work on Exec and blocks the calling thread until it finishes
+template<typename T>
+T SyncWait(Task<T> Work, Executor& Exec = Executor::Default()) {
+    std::promise<T> Promise;
+    std::future<T> Res = Promise.get_future();
+    TaskDetail::RunInto(Exec, std::move(Work), std::move(Promise));
+    return Res.get();
+}
@@ -1,11 +1,20 @@
 #include "Transfer.hpp"
 
-//#include <openssl/sha.h>
 #include <sstream>
 #include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <thread>
 
-uint64_t FNV1(uint8_t* Data, size_t Size) {
-    uint64_t Hash = 14695981039346656037ull;
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+uint64_t FNV1(const uint8_t* Data, size_t Size, uint64_t Hash) {
     for (size_t i = 0; i < Size; ++i) {
         Hash = Hash * 1099511628211ull;
         Hash = Hash ^ static_cast<size_t>(Data[i]);
@@ -13,20 +22,68 @@ uint64_t FNV1(uint8_t* Data, size_t Size) {
     return Hash;
 }
 
-/*std::string SHA256(uint8_t* Data, size_t Size)
-{
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
-    SHA256_Update(&sha256, Data, Size);
-    SHA256_Final(hash, &sha256);
-    std::stringstream ss;
-    for(int i = 0; i < SHA256_DIGEST_LENGTH; i++)
-    {
-        ss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
+std::array<uint8_t, 32> SHA256(const uint8_t* Data, size_t Size) {
+    static const uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+    uint32_t State[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+    auto Rotate = [](uint32_t X, int N) { return (X >> N) | (X << (32 - N)); };
+
+    auto Block = [&](const uint8_t* Bytes) {
+        uint32_t W[64];
+        for (int i = 0; i < 16; ++i) {
+            W[i] = uint32_t(Bytes[i * 4]) << 24 | uint32_t(Bytes[i * 4 + 1]) << 16 | uint32_t(Bytes[i * 4 + 2]) << 8 | Bytes[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t S0 = Rotate(W[i - 15], 7) ^ Rotate(W[i - 15], 18) ^ (W[i - 15] >> 3);
+            uint32_t S1 = Rotate(W[i - 2], 17) ^ Rotate(W[i - 2], 19) ^ (W[i - 2] >> 10);
+            W[i] = W[i - 16] + S0 + W[i - 7] + S1;
+        }
+
+        uint32_t A = State[0], B = State[1], C = State[2], D = State[3], E = State[4], F = State[5], G = State[6], H = State[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t T1 = H + (Rotate(E, 6) ^ Rotate(E, 11) ^ Rotate(E, 25)) + ((E & F) ^ (~E & G)) + K[i] + W[i];
+            uint32_t T2 = (Rotate(A, 2) ^ Rotate(A, 13) ^ Rotate(A, 22)) + ((A & B) ^ (A & C) ^ (B & C));
+            H = G; G = F; F = E; E = D + T1;
+            D = C; C = B; B = A; A = T1 + T2;
+        }
+        State[0] += A; State[1] += B; State[2] += C; State[3] += D;
+        State[4] += E; State[5] += F; State[6] += G; State[7] += H;
+    };
+
+    size_t Whole = Size / 64 * 64;
+    for (size_t i = 0; i < Whole; i += 64) {
+        Block(Data + i);
     }
-    return ss.str();
-}*/
+
+    // The rest, a one bit, zeros, then the length in bits, in one or two blocks
+    uint8_t Tail[128] = { };
+    size_t Rest = Size - Whole;
+    std::copy(Data + Whole, Data + Size, Tail);
+    Tail[Rest] = 0x80;
+    size_t TailSize = Rest < 56 ? 64 : 128;
+    uint64_t Bits = uint64_t(Size) * 8;
+    for (int i = 0; i < 8; ++i) {
+        Tail[TailSize - 1 - i] = uint8_t(Bits >> (i * 8));
+    }
+    for (size_t i = 0; i < TailSize; i += 64) {
+        Block(Tail + i);
+    }
+
+    std::array<uint8_t, 32> Res;
+    for (int i = 0; i < 32; ++i) {
+        Res[i] = uint8_t(State[i / 4] >> (24 - i % 4 * 8));
+    }
+    return Res;
+}
 
 StreamScope::StreamScope(NamedScopes& Ctx, std::string const& Name) : Ctx(Ctx) {
     Ctx.Scopes.push_back(Name);
@@ -35,58 +92,770 @@ StreamScope::~StreamScope() {
     Ctx.Scopes.pop_back();
 }
 
+std::shared_ptr<MappedFile> MappedFile::Open(std::string const& Path) {
+    int Fd = open(Path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (Fd < 0) return nullptr;
+
+    struct stat Info;
+    std::shared_ptr<MappedFile> Res;
+    if (fstat(Fd, &Info) == 0) {
+        Res = FromDescriptor(Fd, static_cast<size_t>(Info.st_size));
+    }
+    close(Fd);
+    return Res;
+}
+
+std::shared_ptr<MappedFile> MappedFile::FromDescriptor(int Fd, size_t Size) {
+    if (Size == 0) return nullptr;
+
+    void* Data = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, Fd, 0);
+    if (Data == MAP_FAILED) return nullptr;
+
+    return std::shared_ptr<MappedFile>(new MappedFile(static_cast<const uint8_t*>(Data), Size));
+}
+
+MappedFile::~MappedFile() {
+    munmap(const_cast<uint8_t*>(Data), Size);
+}
+
+std::shared_ptr<FileHandle> FileHandle::Open(std::string const& Path) {
+    int Fd = open(Path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (Fd < 0) return nullptr;
+    return Adopt(Fd, Path);
+}
+
+std::shared_ptr<FileHandle> FileHandle::Adopt(int Fd, std::string const& Path) {
+    return std::shared_ptr<FileHandle>(new FileHandle(Fd, Path));
+}
+
+std::shared_ptr<FileHandle> FileHandle::Temporary(std::span<const uint8_t> Contents) {
+    std::string Dir = std::filesystem::temp_directory_path().string();
+    int Fd = open(Dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (Fd < 0) return nullptr;
+
+    std::shared_ptr<FileHandle> Res = Adopt(Fd, "");
+    size_t Done = 0;
+    while (Done < Contents.size()) {
+        ssize_t Count = write(Fd, Contents.data() + Done, Contents.size() - Done);
+        if (Count <= 0) return nullptr;
+        Done += static_cast<size_t>(Count);
+    }
+    return Res;
+}
+
+FileHandle::~FileHandle() {
+    close(Fd);
+}
+
+uint64_t FileHandle::Size() const {
+    struct stat Info;
+    if (fstat(Fd, &Info) != 0) return 0;
+    return static_cast<uint64_t>(Info.st_size);
+}
+
+bool FileHandle::ReadAt(uint64_t Offset, std::span<uint8_t> Out) const {
+    size_t Done = 0;
+    while (Done < Out.size()) {
+        ssize_t Count = pread(Fd, Out.data() + Done, Out.size() - Done, static_cast<off_t>(Offset + Done));
+        if (Count <= 0) return false;
+        Done += static_cast<size_t>(Count);
+    }
+    return true;
+}
+
+bool FileHandle::Current(Stamp& Out) const {
+    struct stat Info;
+    if (fstat(Fd, &Info) != 0) return false;
+    Out = Stamp {
+        static_cast<uint64_t>(Info.st_size),
+        static_cast<uint64_t>(Info.st_mtim.tv_sec) * 1000000000ull + static_cast<uint64_t>(Info.st_mtim.tv_nsec),
+        static_cast<uint64_t>(Info.st_ctim.tv_sec) * 1000000000ull + static_cast<uint64_t>(Info.st_ctim.tv_nsec)
+    };
+    return true;
+}
+
+bool FileHandle::HashRange(uint64_t Offset, uint64_t Length, uint64_t& Out) const {
+    Stamp Before;
+    if (!Current(Before)) return false;
+
+    std::pair<uint64_t, uint64_t> Range(Offset, Length);
+    {
+        std::lock_guard<std::mutex> Lock(HashMutex);
+        auto Found = RangeHashes.find(Range);
+        if (Found != RangeHashes.end() && Found->second.first == Before) {
+            Out = Found->second.second;
+            return true;
+        }
+    }
+
+    // Streamed in pieces, so large ranges are never loaded whole
+    uint64_t Hash = 14695981039346656037ull;
+    std::array<uint8_t, 64 * 1024> Piece;
+    for (uint64_t Done = 0; Done < Length; ) {
+        size_t Count = static_cast<size_t>(std::min<uint64_t>(Piece.size(), Length - Done));
+        if (!ReadAt(Offset + Done, std::span<uint8_t>(Piece.data(), Count))) return false;
+        Hash = FNV1(Piece.data(), Count, Hash);
+        Done += Count;
+    }
+
+    // Only kept if the file did not change while it was read
+    Stamp After;
+    if (Current(After) && After == Before) {
+        std::lock_guard<std::mutex> Lock(HashMutex);
+        RangeHashes[Range] = { Before, Hash };
+    }
+    Out = Hash;
+    return true;
+}
+
+static bool WriteAll(int Fd, const uint8_t* Data, size_t Size) {
+    while (Size != 0) {
+        ssize_t Count = write(Fd, Data, Size);
+        if (Count < 0 && errno == EINTR) continue;
+        if (Count <= 0) return false;
+        Data += Count;
+        Size -= static_cast<size_t>(Count);
+    }
+    return true;
+}
+
+// Copies a file range into Out without passing it through user space when the
+// kernel allows: copy_file_range between files, sendfile for anything else,
+// and a plain read/write loop as the last resort
+bool CopyRange(int Out, ExternalRange const& Range) {
+    off_t InOffset = static_cast<off_t>(Range.Offset);
+    uint64_t Left = Range.Length;
+    int In = Range.File->Descriptor();
+
+    bool TryCopyFileRange = true;
+    bool TrySendfile = true;
+    while (Left != 0) {
+        size_t Chunk = static_cast<size_t>(std::min<uint64_t>(Left, 1ull << 30));
+        ssize_t Count = -1;
+
+        if (TryCopyFileRange) {
+            Count = copy_file_range(In, &InOffset, Out, nullptr, Chunk, 0);
+            if (Count < 0 && errno != EINTR) {
+                TryCopyFileRange = false;
+                continue;
+            }
+        } else if (TrySendfile) {
+            Count = sendfile(Out, In, &InOffset, Chunk);
+            if (Count < 0 && errno != EINTR) {
+                TrySendfile = false;
+                continue;
+            }
+        } else {
+            std::array<uint8_t, 64 * 1024> Buffer;
+            Count = pread(In, Buffer.data(), std::min(Chunk, Buffer.size()), InOffset);
+            if (Count > 0) {
+                if (!WriteAll(Out, Buffer.data(), static_cast<size_t>(Count))) return false;
+                InOffset += Count;
+            }
+        }
+
+        if (Count < 0 && errno == EINTR) continue;
+        if (Count <= 0) return false; // Source ended before the range did
+        Left -= static_cast<uint64_t>(Count);
+    }
+    return true;
+}
+
+bool WriteBinarySection(int Fd, JSONSerializer const& Ser) {
+    size_t Written = 0;
+    for (ExternalRange const& Range : Ser.External) {
+        if (!WriteAll(Fd, Ser.Binary.data() + Written, Range.At - Written)) return false;
+        Written = Range.At;
+        if (!Range.File || !CopyRange(Fd, Range)) return false;
+    }
+    return WriteAll(Fd, Ser.Binary.data() + Written, Ser.Binary.size() - Written);
+}
+
+// Opens Path for Deser. Large files are mapped so their binary section can be
+// viewed in place, small ones are read into Buffer. The file is kept open as
+// Deser->Source for file ranges that point back into it.
+template<typename DeserT>
+static std::optional<std::span<const uint8_t>> LoadFile(std::string const& Path, DeserT& Deser, std::vector<uint8_t>& Buffer) {
+    int Fd = open(Path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (Fd < 0) {
+        return std::nullopt;
+    }
+
+    struct stat Info;
+    if (fstat(Fd, &Info) != 0) {
+        close(Fd);
+        return std::nullopt;
+    }
+    size_t Size = static_cast<size_t>(Info.st_size);
+
+    if (Size >= MapThreshold) {
+        Deser.Mapping = MappedFile::FromDescriptor(Fd, Size);
+    }
+
+    Deser.Source = FileHandle::Adopt(Fd, Path);
+
+    if (Deser.Mapping) {
+        return Deser.Mapping->Bytes();
+    }
+
+    Buffer.resize(Size);
+    if (!Deser.Source->ReadAt(0, Buffer)) {
+        return std::nullopt;
+    }
+    return std::span<const uint8_t>(Buffer);
+}
+
+// The JSON text is terminated by a null, everything after it is the binary section
+static size_t BinaryBeginOf(std::span<const uint8_t> Contents, size_t& TextSize) {
+    const uint8_t* TextEnd = static_cast<const uint8_t*>(memchr(Contents.data(), 0, Contents.size()));
+    TextSize = TextEnd ? TextEnd - Contents.data() : Contents.size();
+    return TextEnd ? TextSize + 1 : TextSize;
+}
+
 bool ReadFileJSONCb(std::string const& Path, std::function<void(JSONDeserializer&)> const& Func) {
-    std::ifstream t(Path, std::ios::binary | std::ios::ate);
+    TransferPool<JSONDeserializer>::Handle Deser = TransferPool<JSONDeserializer>::Acquire();
 
-    if (!t.good()) {
+    std::optional<std::span<const uint8_t>> Contents = LoadFile(Path, *Deser, Deser->Binary);
+    if (!Contents) {
         return false;
     }
-    
-    std::vector<uint8_t> buffer;
 
-    {
-        std::streamsize size = t.tellg();
-        t.seekg(0, std::ios::beg);
-        buffer.resize(size);
+    size_t TextSize;
+    size_t BinaryBegin = BinaryBeginOf(*Contents, TextSize);
+    Deser->Data = nlohmann::json::parse(Contents->data(), Contents->data() + TextSize);
+    Deser->SourceBinaryOffset = BinaryBegin;
 
-        if (!t.read(reinterpret_cast<char*>(buffer.data()), size)) {
-            return false;
+    if (Deser->Mapping) {
+        Deser->MappedBinary = Contents->subspan(BinaryBegin);
+    } else {
+        Deser->Binary.erase(Deser->Binary.begin(), Deser->Binary.begin() + BinaryBegin);
+    }
+
+    Func(*Deser);
+
+    return true;
+}
+
+bool ReadFileIndexedCb(std::string const& Path, std::function<void(IndexedDeserializer&)> const& Func, Journal const* Log) {
+    TransferPool<IndexedDeserializer>::Handle Deser = TransferPool<IndexedDeserializer>::Acquire();
+
+    // A logged image has no file behind it, so file ranges in it are spilled
+    std::optional<std::span<const uint8_t>> Contents;
+    if (Log && Log->Read(Path, Deser->Contents)) {
+        Contents = std::span<const uint8_t>(Deser->Contents);
+    } else {
+        Contents = LoadFile(Path, *Deser, Deser->Contents);
+    }
+    if (!Contents) {
+        return false;
+    }
+
+    // Text and binary section stay in place, only the index is built
+    size_t TextSize;
+    Deser->BinaryBegin = BinaryBeginOf(*Contents, TextSize);
+    Deser->SourceBinaryOffset = Deser->BinaryBegin;
+    if (Deser->Mapping) {
+        Deser->MappedBinary = Contents->subspan(Deser->BinaryBegin);
+    }
+
+    Deser->Load(std::string_view(reinterpret_cast<const char*>(Contents->data()), TextSize));
+
+    Func(*Deser);
+
+    return true;
+}
+
+std::vector<FileLoadStatus> ReadFilesIndexedCb(std::span<const std::string> Paths, std::function<void(size_t, IndexedDeserializer&)> const& Func, size_t Workers, std::span<Journal const* const> Logs) {
+    std::vector<FileLoadStatus> Res(Paths.size());
+    if (Workers == 0) {
+        Workers = std::max<size_t>(1, std::thread::hardware_concurrency());
+    }
+    Workers = std::min(Workers, Paths.size());
+
+    // Workers claim the next unread path, so slow files do not hold up a whole share
+    std::atomic<size_t> Next = 0;
+    auto Work = [&]() {
+        for (size_t i = Next++; i < Paths.size(); i = Next++) {
+            FileLoadStatus& Status = Res[i];
+            Status.Path = Paths[i];
+            try {
+                Status.Found = ReadFileIndexedCb(Paths[i], [&Func, i](IndexedDeserializer& Deser) {
+                    Func(i, Deser);
+                }, i < Logs.size() ? Logs[i] : nullptr);
+            } catch (StreamTransferError const& Err) {
+                // Only decoding throws, so the file was read
+                Status.Found = true;
+                Status.Error = Err.Message;
+            } catch (std::exception const& Err) {
+                Status.Found = true;
+                Status.Error = Err.what();
+            }
         }
+    };
+
+    std::vector<std::thread> Threads;
+    for (size_t i = 1; i < Workers; ++i) {
+        Threads.emplace_back(Work);
+    }
+    Work();
+    for (std::thread& Thread : Threads) {
+        Thread.join();
     }
 
-    std::string StringData = reinterpret_cast<char*>(buffer.data());
-    buffer.erase(buffer.begin() + StringData.size() + 1, buffer.end());
+    return Res;
+}
 
-    JSONDeserializer Deser;
-    Deser.Data = nlohmann::json::parse(StringData);
-    Deser.Binary = std::move(buffer);
+void IndexedDeserializer::Load(std::string_view Text) {
+    std::string Error;
+    if (!Document.Load(Text, Error)) {
+        throw StreamTransferError { "Malformed JSON: " + Error + "\n" + DumpScopes() };
+    }
 
-    Func(Deser);
+    Depth = 0;
+    DecodedKeys.clear();
+    switch (Document.KindOf(IndexedJSON::Root)) {
+    case IndexedJSON::Kind::Object:
+    case IndexedJSON::Kind::Array:
+    case IndexedJSON::Kind::Null:
+        PushFrame(Document.KindOf(IndexedJSON::Root), Document.ContainerToken(IndexedJSON::Root));
+        break;
+    default:
+        throw StreamTransferError { "Top level JSON value is not an object\n" + DumpScopes() };
+    }
+}
 
+IndexedDeserializer::Frame& IndexedDeserializer::PushFrame(IndexedJSON::Kind Kind, uint32_t Open) {
+    if (Depth == Frames.size()) Frames.emplace_back();
+    Frame& Top = Frames[Depth++];
+    Top.Open = Open;
+    Top.Kind = Kind;
+    Top.Listed = false;
+    Top.Members.clear();
+    return Top;
+}
+
+void IndexedDeserializer::ListMembers(Frame& Top) {
+    Top.Listed = true;
+    if (Top.Kind == IndexedJSON::Kind::Array) {
+        Document.ForEachElement(Top.Open, [&Top](uint32_t Prev) {
+            Top.Members.push_back({ { }, Prev });
+        });
+        return;
+    }
+    if (Top.Kind != IndexedJSON::Kind::Object) return;
+
+    Document.ForEachMember(Top.Open, [this, &Top](std::string_view Key, uint32_t Prev) {
+        if (Key.find('\\') != std::string_view::npos) {
+            std::string& Decoded = DecodedKeys.emplace_back();
+            if (!IndexedJSON::Unescape(Key, Decoded)) {
+                throw StreamTransferError { "Malformed key " + std::string(Key) + "\n" + DumpScopes() };
+            }
+            Key = Decoded;
+        }
+        Top.Members.push_back({ Key, Prev });
+    });
+
+    // Serialized files already have their keys in order
+    auto Less = [](Member const& Lhs, Member const& Rhs) { return Lhs.Key < Rhs.Key; };
+    if (Top.Members.size() > LinearMembers && !std::is_sorted(Top.Members.begin(), Top.Members.end(), Less)) {
+        std::stable_sort(Top.Members.begin(), Top.Members.end(), Less);
+    }
+}
+
+bool IndexedDeserializer::Find(std::string const& Name, uint32_t& Prev) {
+    if (Depth == 0) return false;
+    Frame& Top = Frames[Depth - 1];
+    if (!Top.Listed) ListMembers(Top);
+
+    if (Top.Kind == IndexedJSON::Kind::Array) {
+        size_t Index;
+        auto [Ptr, Ec] = std::from_chars(Name.data(), Name.data() + Name.size(), Index);
+        if (Ec != std::errc() || Ptr != Name.data() + Name.size() || Index >= Top.Members.size()) return false;
+        Prev = Top.Members[Index].Prev;
+        return true;
+    }
+
+    // Like nlohmann, the last of any duplicate keys wins
+    std::string_view Key = Name;
+    if (Top.Members.size() <= LinearMembers) {
+        for (size_t i = Top.Members.size(); i-- > 0;) {
+            if (Top.Members[i].Key == Key) {
+                Prev = Top.Members[i].Prev;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    auto It = std::upper_bound(Top.Members.begin(), Top.Members.end(), Key, [](std::string_view Lhs, Member const& Rhs) { return Lhs < Rhs.Key; });
+    if (It == Top.Members.begin() || std::prev(It)->Key != Key) return false;
+    Prev = std::prev(It)->Prev;
     return true;
 }
 
-void WriteFileJSONCb(std::string const& Path, std::function<void(JSONSerializer&)> const& Func) {
-    JSONSerializer Ser;
+void IndexedDeserializer::BeginScope(std::string const& Name) {
+    uint32_t Prev = FindChecked(Name);
+    IndexedJSON::Kind Kind = Document.KindOf(Prev);
+
+    // Scopes nothing was pushed into are written as null
+    if (Kind != IndexedJSON::Kind::Object && Kind != IndexedJSON::Kind::Array && Kind != IndexedJSON::Kind::Null) {
+        throw StreamTransferError { "Scope " + Name + " is not an object:\n" + DumpScopes() };
+    }
+    PushFrame(Kind, Document.ContainerToken(Prev));
+}
+
+// Just enough of a JSON reader to step over values without building them
+struct JSONScanner {
+    const char* Pos;
+    const char* End;
+
+    [[noreturn]] void Fail(std::string const& What) {
+        throw StreamTransferError { "Malformed JSON while scanning: " + What + "\n" };
+    }
+
+    void SkipSpace() {
+        while (Pos < End && (*Pos == ' ' || *Pos == '\n' || *Pos == '\r' || *Pos == '\t')) ++Pos;
+    }
+
+    void Expect(char C) {
+        SkipSpace();
+        if (Pos >= End || *Pos != C) Fail(std::string("expected '") + C + "'");
+        ++Pos;
+    }
+
+    // Pos at an opening quote, leaves it after the closing one
+    void SkipString() {
+        ++Pos;
+        while (Pos < End && *Pos != '"') {
+            Pos += (*Pos == '\\') ? 2 : 1;
+        }
+        if (Pos >= End) Fail("unterminated string");
+        ++Pos;
+    }
+
+    std::string ReadString() {
+        SkipSpace();
+        if (Pos >= End || *Pos != '"') Fail("expected a string");
+        const char* Begin = Pos;
+        SkipString();
+        if (std::find(Begin, Pos, '\\') == Pos) {
+            return std::string(Begin + 1, Pos - 1);
+        }
+        return nlohmann::json::parse(Begin, Pos).get<std::string>();
+    }
+
+    void SkipValue() {
+        SkipSpace();
+        if (Pos >= End) Fail("expected a value");
+
+        if (*Pos == '"') {
+            SkipString();
+        } else if (*Pos == '{' || *Pos == '[') {
+            size_t Depth = 0;
+            while (Pos < End) {
+                char C = *Pos;
+                if (C == '"') {
+                    SkipString();
+                    continue;
+                }
+                ++Pos;
+                if (C == '{' || C == '[') ++Depth;
+                if ((C == '}' || C == ']') && --Depth == 0) return;
+            }
+            Fail("unterminated container");
+        } else {
+            while (Pos < End && *Pos != ',' && *Pos != '}' && *Pos != ']' && *Pos != ' ' && *Pos != '\n' && *Pos != '\r' && *Pos != '\t') ++Pos;
+        }
+    }
+
+    // Pos at an object, moves Pos to the value of the member called Name
+    bool FindMember(std::string const& Name) {
+        Expect('{');
+        SkipSpace();
+        if (Pos < End && *Pos == '}') return false;
+
+        while (true) {
+            std::string Key = ReadString();
+            Expect(':');
+            SkipSpace();
+            if (Key == Name) return true;
+
+            SkipValue();
+            SkipSpace();
+            if (Pos >= End || *Pos != ',') return false;
+            ++Pos;
+        }
+    }
+
+    // Calls Func(Key) for each member of the object at Pos, with Pos at the
+    // member's value. Func must leave Pos after the value.
+    template<typename FuncT>
+    void ForEachMember(FuncT const& Func) {
+        Expect('{');
+        SkipSpace();
+        if (Pos < End && *Pos == '}') {
+            ++Pos;
+            return;
+        }
+
+        while (true) {
+            std::string Key = ReadString();
+            Expect(':');
+            SkipSpace();
+            Func(Key);
+            SkipSpace();
+            if (Pos < End && *Pos == ',') {
+                ++Pos;
+                continue;
+            }
+            Expect('}');
+            return;
+        }
+    }
+};
+
+StoredVector StoredVector::Open(std::string const& Path, std::vector<std::string> const& Scope) {
+    StoredVector Res;
 
-    Func(Ser);
+    Res.Source = FileHandle::Open(Path);
+    if (!Res.Source) return Res;
+
+    // Nothing to map, and nothing written yet, so as good as missing
+    if (Res.Source->Size() == 0) return StoredVector();
+
+    Res.Mapping = MappedFile::FromDescriptor(Res.Source->Descriptor(), Res.Source->Size());
+    if (!Res.Mapping) {
+        throw StreamTransferError { "Could not map " + Path + "\n" };
+    }
+
+    std::span<const uint8_t> Contents = Res.Mapping->Bytes();
+    const char* Text = reinterpret_cast<const char*>(Contents.data());
+    const char* TextEnd = static_cast<const char*>(memchr(Text, 0, Contents.size()));
+    if (!TextEnd) TextEnd = Text + Contents.size();
+    Res.BinaryOffset = std::min<uint64_t>(TextEnd - Text + 1, Contents.size());
+
+    JSONScanner Scanner { Text, TextEnd };
+    for (std::string const& Name : Scope) {
+        if (!Scanner.FindMember(Name)) {
+            throw StreamTransferError { "Scope " + Name + " not found in " + Path + "\n" };
+        }
+    }
+
+    // Members come in key order ("0", "1", "10", ..., "Size"), not index order
+    std::optional<size_t> Size;
+    std::vector<std::pair<size_t, std::pair<size_t, size_t>>> Found;
+    Scanner.ForEachMember([&](std::string const& Key) {
+        const char* Begin = Scanner.Pos;
+        Scanner.SkipValue();
+
+        if (Key == "Size") {
+            Size = nlohmann::json::parse(Begin, Scanner.Pos).get<size_t>();
+            return;
+        }
+
+        size_t Index;
+        auto [Last, Error] = std::from_chars(Key.data(), Key.data() + Key.size(), Index);
+        if (Error == std::errc() && Last == Key.data() + Key.size()) {
+            Found.push_back({ Index, { Begin - Text, Scanner.Pos - Text } });
+        }
+    });
+
+    if (!Size || Found.size() != *Size) {
+        throw StreamTransferError { "Stored vector in " + Path + " has inconsistent elements\n" };
+    }
 
-    std::ofstream t(Path, std::ios::trunc | std::ios::binary);
-    std::string stringData = Ser.Data.dump(2);
+    Res.Elements.resize(*Size);
+    std::vector<bool> Seen(*Size, false);
+    for (auto const& [Index, Range] : Found) {
+        if (Index >= *Size || Seen[Index]) {
+            throw StreamTransferError { "Stored vector in " + Path + " has inconsistent elements\n" };
+        }
+        Seen[Index] = true;
+        Res.Elements[Index] = Range;
+    }
+
+    return Res;
+}
+
+void StoredVector::Prepare(JSONDeserializer& Deser, size_t Index) const {
+    std::span<const uint8_t> Contents = Mapping->Bytes();
+    auto [Begin, End] = Elements[Index];
+
+    Deser.Data = nlohmann::json::object();
+    Deser.Data["Element"] = nlohmann::json::parse(Contents.data() + Begin, Contents.data() + End);
+    Deser.Mapping = Mapping;
+    Deser.MappedBinary = Contents.subspan(BinaryOffset);
+    Deser.Source = Source;
+    Deser.SourceBinaryOffset = BinaryOffset;
+}
+
+void FinishText(JSONSerializer& Ser, size_t HeaderSizeHint) {
+    std::string& stringData = Ser.Text;
+    stringData.reserve(HeaderSizeHint);
+    Ser.DumpString(stringData, 2);
+
+    // Trailing whitespace is still valid JSON, use it to align the binary section
+    if (Ser.BinarySize() != 0) {
+        stringData.resize(AlignUp(stringData.size() + 1, BinaryAlignment) - 1, ' ');
+    }
     stringData.push_back('\0');
-    t << stringData;
+}
+
+bool WriteFileJSONCb(std::string const& Path, std::function<void(JSONSerializer&)> const& Func, size_t HeaderSizeHint) {
+    TransferPool<JSONSerializer>::Handle Ser = TransferPool<JSONSerializer>::Acquire();
 
-    t.write(reinterpret_cast<char*>(Ser.Binary.data()), Ser.Binary.size());
+    Func(*Ser);
+    FinishText(*Ser, HeaderSizeHint);
+    std::string& stringData = Ser->Text;
+
+    // Written beside Path and renamed over it, so ranges still reading from
+    // the old file are never overwritten underneath them
+    static std::atomic<uint64_t> TempCounter = 0;
+    std::string TempPath = Path + ".tmp." + std::to_string(getpid()) + "." + std::to_string(TempCounter++);
+
+    int Fd = open(TempPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (Fd < 0) {
+        return false;
+    }
+
+    bool Ok = WriteAll(Fd, reinterpret_cast<const uint8_t*>(stringData.data()), stringData.size())
+        && WriteBinarySection(Fd, *Ser);
+    Ok = (close(Fd) == 0) && Ok;
+
+    if (!Ok || rename(TempPath.c_str(), Path.c_str()) != 0) {
+        unlink(TempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+std::vector<uint8_t> EncodeFileJSONCb(std::function<void(JSONSerializer&)> const& Func, size_t HeaderSizeHint) {
+    TransferPool<JSONSerializer>::Handle Ser = TransferPool<JSONSerializer>::Acquire();
+
+    Func(*Ser);
+    FinishText(*Ser, HeaderSizeHint);
+
+    std::vector<uint8_t> Res;
+    Res.reserve(Ser->Text.size() + Ser->BinarySize());
+    Res.insert(Res.end(), Ser->Text.begin(), Ser->Text.end());
+
+    size_t Copied = 0;
+    for (ExternalRange const& Range : Ser->External) {
+        Res.insert(Res.end(), Ser->Binary.begin() + Copied, Ser->Binary.begin() + Range.At);
+        Copied = Range.At;
+
+        size_t At = Res.size();
+        Res.resize(At + Range.Length);
+        if (!Range.File || !Range.File->ReadAt(Range.Offset, std::span<uint8_t>(Res.data() + At, Range.Length))) {
+            throw StreamTransferError { "File range could not be read for encoding\n" };
+        }
+    }
+    Res.insert(Res.end(), Ser->Binary.begin() + Copied, Ser->Binary.end());
+    return Res;
 }
 
 uint64_t HashCb(std::function<void(JSONSerializer&)> const& Func) {
-    JSONSerializer Ser;
+    TransferPool<JSONSerializer>::Handle Ser = TransferPool<JSONSerializer>::Acquire();
 
-    Func(Ser);
-    std::string StringData = Ser.Data.dump();
+    Func(*Ser);
+    std::string& StringData = Ser->Text;
+    Ser->DumpString(StringData);
     uint64_t Hashes[2];
     Hashes[0] = FNV1(reinterpret_cast<uint8_t*>(StringData.data()), StringData.size());
-    Hashes[1] = FNV1(Ser.Binary.data(), Ser.Binary.size());
+
+    // External ranges are hashed by content, through their file's cache of range hashes
+    Hashes[1] = 14695981039346656037ull;
+    size_t Hashed = 0;
+    for (ExternalRange const& Range : Ser->External) {
+        Hashes[1] = FNV1(Ser->Binary.data() + Hashed, Range.At - Hashed, Hashes[1]);
+        Hashed = Range.At;
+
+        uint64_t RangeHash;
+        if (!Range.File || !Range.File->HashRange(Range.Offset, Range.Length, RangeHash)) {
+            throw StreamTransferError { "File range could not be read for hashing\n" };
+        }
+        Hashes[1] = FNV1(reinterpret_cast<uint8_t*>(&RangeHash), sizeof(RangeHash), Hashes[1]);
+    }
+    Hashes[1] = FNV1(Ser->Binary.data() + Hashed, Ser->Binary.size() - Hashed, Hashes[1]);
 
     return FNV1(reinterpret_cast<uint8_t*>(Hashes), sizeof(Hashes));
-}
\ No newline at end of file
+}
+
+void HashTree::Resize(size_t Count) {
+    size_t OldCount = Leaves.size();
+    if (Count == OldCount) return;
+
+    size_t First = std::min(Count, OldCount) / ChunkSize;
+    size_t Last = (std::max(Count, OldCount) + ChunkSize - 1) / ChunkSize;
+    Leaves.resize(Count, 0);
+    for (size_t Chunk = First; Chunk < Last; ++Chunk) {
+        MarkDirty(Chunk);
+    }
+}
+
+void HashTree::Set(size_t Index, uint64_t ElementHash) {
+    Leaves[Index] = ElementHash;
+    MarkDirty(Index / ChunkSize);
+}
+
+void HashTree::MarkDirty(size_t Chunk) {
+    if (Dirty.empty() || Dirty.back() != Chunk) {
+        Dirty.push_back(Chunk);
+    }
+}
+
+uint64_t HashTree::Root() {
+    size_t Chunks = (Leaves.size() + ChunkSize - 1) / ChunkSize;
+
+    // The tree is always the smallest power of two wide that fits, so the
+    // root depends only on the current elements and not on their history
+    size_t NewWidth = Chunks == 0 ? 0 : 1;
+    while (NewWidth < Chunks) NewWidth *= 2;
+
+    if (NewWidth != Width) {
+        Width = NewWidth;
+        Nodes.assign(2 * Width, 0);
+        Dirty.clear();
+        for (size_t Chunk = 0; Chunk < Chunks; ++Chunk) {
+            Dirty.push_back(Chunk);
+        }
+    }
+
+    if (!Dirty.empty()) {
+        std::sort(Dirty.begin(), Dirty.end());
+        Dirty.erase(std::unique(Dirty.begin(), Dirty.end()), Dirty.end());
+
+        for (size_t& Chunk : Dirty) {
+            if (Chunk >= Width) {
+                Chunk = 0;
+                continue;
+            }
+            uint64_t& Node = Nodes[Width + Chunk];
+            if (Chunk < Chunks) {
+                size_t Begin = Chunk * ChunkSize;
+                size_t End = std::min(Begin + ChunkSize, Leaves.size());
+                Node = FNV1(reinterpret_cast<uint8_t*>(&Leaves[Begin]), (End - Begin) * sizeof(uint64_t));
+            } else {
+                Node = 0;
+            }
+            Chunk = (Width + Chunk) / 2;
+        }
+
+        // Dirty now holds parent indices, recompute one level at a time
+        while (true) {
+            std::sort(Dirty.begin(), Dirty.end());
+            Dirty.erase(std::unique(Dirty.begin(), Dirty.end()), Dirty.end());
+            if (Dirty.empty() || Dirty.back() == 0) break;
+
+            for (size_t& Index : Dirty) {
+                if (Index == 0) continue;
+                Nodes[Index] = FNV1(reinterpret_cast<uint8_t*>(&Nodes[2 * Index]), 2 * sizeof(uint64_t));
+                Index /= 2;
+            }
+        }
+        Dirty.clear();
+    }
+
+    uint64_t Summary[2] = { Width == 0 ? 0 : Nodes[1], Leaves.size() };
+    return FNV1(reinterpret_cast<uint8_t*>(Summary), sizeof(Summary));
+}
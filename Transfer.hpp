@@ -5,10 +5,26 @@
 #include <concepts>
 #include <fstream>
 #include <sstream>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <optional>
+#include <typeindex>
+#include <unordered_map>
+#include <span>
+#include <new>
+#include <charconv>
+#include <deque>
+#include <map>
+#include <mutex>
 
 #include <iostream>
 #include <nlohmann/json.hpp>
 
+#include "Generator.hpp"
+#include "IndexedJSON.hpp"
+#include "Journal.hpp"
+
 struct StreamTransferError {
     std::string Message;
 };
@@ -23,13 +39,122 @@ struct StreamScope {
 };
 
 #define EasyPush(CtxName, VarName) CtxName.template Push(#VarName, VarName)
-#define EasyConsume(CtxName, VarName) VarName = CtxName.template Consume<decltype(VarName)>(#VarName)
+#define EasyConsume(CtxName, VarName) CtxName.template ConsumeInto(#VarName, VarName)
 
 using HashResult = std::string;
 
+// Continues from a previous call, so a sequence of pieces hashes like their concatenation
+uint64_t FNV1(const uint8_t* Data, size_t Size, uint64_t Hash = 14695981039346656037ull);
+
+// For names that must not collide even when the bytes are chosen to make them
+std::array<uint8_t, 32> SHA256(const uint8_t* Data, size_t Size);
+
 template <class T>
 concept Primitive = (std::is_integral<T>::value || std::is_floating_point<T>::value || std::is_same<T, bool>::value || std::is_same<T, std::string>::value);
 
+// Files pad their JSON text so the binary section starts on this boundary,
+// and PushBytes can align payloads within it to the same boundary
+constexpr size_t BinaryAlignment = 64;
+
+inline size_t AlignUp(size_t Value, size_t Alignment) {
+    return (Value + Alignment - 1) / Alignment * Alignment;
+}
+
+template<typename T, size_t Alignment = BinaryAlignment>
+struct AlignedAllocator {
+    using value_type = T;
+
+    template<typename U>
+    struct rebind { using other = AlignedAllocator<U, Alignment>; };
+
+    AlignedAllocator() = default;
+    template<typename U>
+    AlignedAllocator(AlignedAllocator<U, Alignment> const&) { }
+
+    T* allocate(size_t Count) {
+        return static_cast<T*>(::operator new(Count * sizeof(T), std::align_val_t(Alignment)));
+    }
+
+    void deallocate(T* Ptr, size_t) {
+        ::operator delete(Ptr, std::align_val_t(Alignment));
+    }
+
+    template<typename U>
+    bool operator==(AlignedAllocator<U, Alignment> const&) const { return true; }
+};
+
+// Read-only mapping of a whole file
+class MappedFile {
+public:
+    // Returns null if the file cannot be opened or mapped
+    static std::shared_ptr<MappedFile> Open(std::string const& Path);
+    static std::shared_ptr<MappedFile> FromDescriptor(int Fd, size_t Size);
+
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+    ~MappedFile();
+
+    std::span<const uint8_t> Bytes() const { return { Data, Size }; }
+
+private:
+    const uint8_t* Data;
+    size_t Size;
+
+    MappedFile(const uint8_t* Data, size_t Size)
+    : Data(Data), Size(Size) { }
+};
+
+// Read-only descriptor shared by everything that refers into the file, so the
+// data stays reachable even after the path is replaced or removed
+class FileHandle {
+public:
+    // Returns null if the file cannot be opened
+    static std::shared_ptr<FileHandle> Open(std::string const& Path);
+    static std::shared_ptr<FileHandle> Adopt(int Fd, std::string const& Path);
+
+    // Unnamed temporary file holding Contents, removed once the last handle is gone
+    static std::shared_ptr<FileHandle> Temporary(std::span<const uint8_t> Contents);
+
+    FileHandle(FileHandle const&) = delete;
+    FileHandle& operator=(FileHandle const&) = delete;
+    ~FileHandle();
+
+    int Descriptor() const { return Fd; }
+    std::string const& GetPath() const { return Path; }
+    uint64_t Size() const;
+
+    // Fills Out from Offset, false if the file ends first
+    bool ReadAt(uint64_t Offset, std::span<uint8_t> Out) const;
+
+    // Hash of Length bytes from Offset, false if the file ends first. Kept
+    // per range and reused while the file's size and times are unchanged.
+    bool HashRange(uint64_t Offset, uint64_t Length, uint64_t& Out) const;
+
+private:
+    int Fd;
+    std::string Path;
+
+    // Size, modification and change time the hash was taken at
+    using Stamp = std::array<uint64_t, 3>;
+
+    mutable std::mutex HashMutex;
+    mutable std::map<std::pair<uint64_t, uint64_t>, std::pair<Stamp, uint64_t>> RangeHashes;
+
+    bool Current(Stamp& Out) const;
+
+    FileHandle(int Fd, std::string const& Path)
+    : Fd(Fd), Path(Path) { }
+};
+
+// Part of a serializer's binary section that is copied from a file when written
+struct ExternalRange {
+    // Position in the in-memory binary this range is spliced in before
+    size_t At;
+    std::shared_ptr<FileHandle> File;
+    uint64_t Offset;
+    uint64_t Length;
+};
+
 struct NamedScopes {
     std::vector<std::string> Scopes;
 
@@ -46,12 +171,97 @@ struct NamedScopes {
     inline virtual void EndScope() { }
 };
 
+// Identity of objects already written through Shared<T>, so each one is sent once
+struct SharedSendTable {
+    std::unordered_map<const void*, uint64_t> Ids;
+
+    // Returns the id for Ptr, setting First when this is its first occurrence
+    inline uint64_t Assign(const void* Ptr, bool& First) {
+        auto [It, Inserted] = Ids.try_emplace(Ptr, Ids.size() + 1);
+        First = Inserted;
+        return It->second;
+    }
+
+    inline void Clear() {
+        Ids.clear();
+    }
+};
+
+// Objects already rebuilt from Shared<T> references, by id
+struct SharedReceiveTable {
+    struct Entry {
+        std::shared_ptr<void> Object;
+        std::type_index Type;
+    };
+
+    std::unordered_map<uint64_t, Entry> Objects;
+
+    template<typename T>
+    inline std::shared_ptr<T> Find(uint64_t Id) {
+        auto It = Objects.find(Id);
+        if (It == Objects.end()) return nullptr;
+        if (It->second.Type != std::type_index(typeid(T))) {
+            throw StreamTransferError { "Shared object " + std::to_string(Id) + " referenced with a different type\n" };
+        }
+        return std::static_pointer_cast<T>(It->second.Object);
+    }
+
+    template<typename T>
+    inline void Add(uint64_t Id, std::shared_ptr<T> const& Object) {
+        Objects.insert_or_assign(Id, Entry { Object, std::type_index(typeid(T)) });
+    }
+
+    inline void Clear() {
+        Objects.clear();
+    }
+};
+
+// Clears a buffer for reuse, keeping its allocation unless it grew past MaxRetainedBytes
+template<typename T>
+inline void ClearRetained(T& Container, size_t MaxRetainedBytes) {
+    if (Container.capacity() * sizeof(typename T::value_type) > MaxRetainedBytes) {
+        T().swap(Container);
+    } else {
+        Container.clear();
+    }
+}
+
 struct JSONSerializer : public NamedScopes {
     nlohmann::json Data;
     std::vector<uint8_t> Binary;
 
     std::vector<nlohmann::json*> Scopes;
 
+    // File ranges spliced into the binary section, in order. They are never
+    // loaded, only streamed into the output when it is written.
+    std::vector<ExternalRange> External;
+    uint64_t ExternalBytes = 0;
+
+    SharedSendTable Shared;
+
+    // Set while computing Hash; lets types substitute cached hashes for their contents
+    bool Hashing = false;
+
+    // Scratch output for dumping Data, kept so pooled serializers reuse it
+    std::string Text;
+
+    inline void Reset(size_t MaxRetainedBytes) {
+        Data = nullptr;
+        ClearRetained(Binary, MaxRetainedBytes);
+        ClearRetained(Text, MaxRetainedBytes);
+        Scopes.clear();
+        NamedScopes::Scopes.clear();
+        External.clear();
+        ExternalBytes = 0;
+        Shared.Clear();
+        Hashing = false;
+    }
+
+    // Size of the binary section including external ranges
+    inline uint64_t BinarySize() const {
+        return Binary.size() + ExternalBytes;
+    }
+
     nlohmann::json& GetCurrentScope() {
         return Scopes.empty() ? Data : *Scopes.back();
     }
@@ -83,17 +293,26 @@ struct JSONSerializer : public NamedScopes {
         GetCurrentScope()[Name] = static_cast<typename std::underlying_type<T>::type>(Val);
     }
 
-    inline void PushBytes(std::string const& Name, const std::vector<uint8_t>& Bytes) {
+    inline void PushBytes(std::string const& Name, std::span<const uint8_t> Bytes, size_t Alignment = 1) {
         //std::string Base64;
         //Base64Encode(Base64, Bytes.data(), Bytes.size());
         //AtChecked(Name) = Base64;
-        size_t Begin = Binary.size();
-        size_t End = Binary.size() + Bytes.size();
+        Binary.resize(Binary.size() + (AlignUp(BinarySize(), Alignment) - BinarySize()), 0);
+        uint64_t Begin = BinarySize();
+        uint64_t End = Begin + Bytes.size();
         AtChecked("Begin") = Begin;
         AtChecked("End") = End;
         Binary.insert(Binary.end(), Bytes.begin(), Bytes.end());
     }
 
+    inline void PushFileRange(std::string const& Name, std::shared_ptr<FileHandle> const& File, uint64_t Offset, uint64_t Length) {
+        uint64_t Begin = BinarySize();
+        AtChecked("Begin") = Begin;
+        AtChecked("End") = Begin + Length;
+        External.push_back(ExternalRange { Binary.size(), File, Offset, Length });
+        ExternalBytes += Length;
+    }
+
     inline virtual void BeginScope(std::string const& Name) override {
         nlohmann::json& NewScope = AtChecked(Name);
         Scopes.push_back(&NewScope);
@@ -109,6 +328,12 @@ struct JSONSerializer : public NamedScopes {
         OutData.resize(OldIndex + StringData.size() + 1);
         memcpy(&OutData[OldIndex], StringData.data(), StringData.size() + 1);
     }
+
+    // Same output as Data.dump(Indent), appended to Out so callers can reserve it up front
+    void DumpString(std::string& Out, int Indent = -1) {
+        nlohmann::detail::serializer<nlohmann::json> Writer(nlohmann::detail::output_adapter<char>(Out), ' ');
+        Writer.dump(Data, Indent >= 0, false, Indent >= 0 ? static_cast<unsigned int>(Indent) : 0);
+    }
 };
 
 struct JSONDeserializer : public NamedScopes {
@@ -117,6 +342,43 @@ struct JSONDeserializer : public NamedScopes {
 
     std::vector<nlohmann::json*> Scopes;
 
+    SharedReceiveTable Shared;
+
+    // Decode into the existing objects instead of building new ones, reusing
+    // their strings and containers. Containers only construct or destroy the
+    // difference in size.
+    bool InPlace = false;
+
+    // Set when the source file is memory mapped, the binary section is then
+    // MappedBinary inside it instead of Binary
+    std::shared_ptr<const MappedFile> Mapping;
+    std::span<const uint8_t> MappedBinary;
+
+    // File the binary section was read from, and where in it the section starts
+    std::shared_ptr<FileHandle> Source;
+    uint64_t SourceBinaryOffset = 0;
+
+    inline void Reset(size_t MaxRetainedBytes) {
+        Data = nullptr;
+        ClearRetained(Binary, MaxRetainedBytes);
+        Scopes.clear();
+        NamedScopes::Scopes.clear();
+        Shared.Clear();
+        Mapping.reset();
+        MappedBinary = { };
+        Source.reset();
+        SourceBinaryOffset = 0;
+        InPlace = false;
+    }
+
+    inline std::span<const uint8_t> BinarySection() const {
+        return Mapping ? MappedBinary : std::span<const uint8_t>(Binary);
+    }
+
+    inline bool Has(std::string const& Name) {
+        return GetCurrentScope().contains(Name);
+    }
+
     nlohmann::json& GetCurrentScope() {
         return Scopes.empty() ? Data : *Scopes.back();
     }
@@ -168,9 +430,33 @@ struct JSONDeserializer : public NamedScopes {
         }
     }
 
+    // Same as Value = Consume<T>(Name), but decodes into Value when InPlace is set
+    template<typename T>
+    inline void ConsumeInto(std::string const& Name, T& Value) {
+        if (!InPlace) {
+            Value = Consume<T>(Name);
+        } else if constexpr (std::is_same<T, std::string>::value) {
+            auto Element = GetCurrentScope().find(Name);
+            if (Element == GetCurrentScope().end()) {
+                throw StreamTransferError { "Element named " + Name + " does not exist:\n" + DumpScopes() };
+            }
+            if (!Element->is_string()) {
+                throw StreamTransferError { "Wrong Type: expected a string for " + Name + "\n" + DumpScopes() };
+            }
+            Value.assign(Element->template get_ref<const std::string&>());
+            GetCurrentScope().erase(Element);
+        } else if constexpr (Primitive<T> || std::is_enum<T>::value) {
+            Value = Consume<T>(Name);
+        } else {
+            BeginScope(Name);
+            Value.Receive(*this);
+            EndScope();
+        }
+    }
+
     template<typename T>
     inline void ConsumeCheck(std::string const& Name, const T& Value) {
-        if (ConsumeValue<T>(Name) != Value) {
+        if (Consume<T>(Name) != Value) {
             throw StreamTransferError { "Checked consume did not match expected value:\n" + DumpScopes() };
         }
     }
@@ -183,16 +469,29 @@ struct JSONDeserializer : public NamedScopes {
             throw StreamTransferError { "Ran out of bytes:\n" + DumpScopes() };
         }*/
 
+        std::span<const uint8_t> Range = ViewBytes(Name);
         Bytes.resize(0);
+        Bytes.insert(Bytes.end(), Range.begin(), Range.end());
+    }
+
+    // The bytes pushed under Name, viewed in place in the binary section
+    inline std::span<const uint8_t> ViewBytes(std::string const& Name) {
+        auto [Begin, End] = ConsumeByteRange(Name);
+        return BinarySection().subspan(Begin, End - Begin);
+    }
+
+    // Offsets of the bytes pushed under Name within the binary section
+    inline std::pair<size_t, size_t> ConsumeByteRange(std::string const& Name) {
         size_t Begin = AtChecked("Begin").get<size_t>();
         size_t End = AtChecked("End").get<size_t>();
+        std::span<const uint8_t> Section = BinarySection();
 
-        if (End < Begin || Begin > Binary.size() || End > Binary.size()) {
-            std::cout << Binary.size() << "," << End << "\n";
+        if (End < Begin || Begin > Section.size() || End > Section.size()) {
+            std::cout << Section.size() << "," << End << "\n";
             throw StreamTransferError { "Binary range was invalid:\n" + DumpScopes() };
         }
 
-        Bytes.insert(Bytes.end(), Binary.begin() + Begin, Binary.begin() + End);
+        return { Begin, End };
     }
 
     inline virtual void BeginScope(std::string const& Name) override {
@@ -204,6 +503,444 @@ struct JSONDeserializer : public NamedScopes {
     }
 };
 
+// Deserializer that reads straight from an IndexedJSON document. Nothing is
+// decoded up front, each Consume finds its member through the structural index
+// and decodes only that value. Drop-in for JSONDeserializer in Receive.
+struct IndexedDeserializer : public NamedScopes {
+    IndexedJSON Document;
+
+    // Whole file when it was read rather than mapped, text then binary section
+    std::vector<uint8_t> Contents;
+    size_t BinaryBegin = 0;
+
+    SharedReceiveTable Shared;
+
+    // See JSONDeserializer::InPlace
+    bool InPlace = false;
+
+    std::shared_ptr<const MappedFile> Mapping;
+
+    // Binary section when it is not in Contents: in Mapping, or in memory the
+    // caller lends for the duration of the decode
+    std::span<const uint8_t> MappedBinary;
+
+    std::shared_ptr<FileHandle> Source;
+    uint64_t SourceBinaryOffset = 0;
+
+    struct Member {
+        std::string_view Key;
+        uint32_t Prev;
+    };
+
+    // An open object or array. Members are listed the first time one is looked
+    // up, and sorted for binary search once there are more than LinearMembers.
+    struct Frame {
+        uint32_t Open = 0;
+        IndexedJSON::Kind Kind = IndexedJSON::Kind::Null;
+        bool Listed = false;
+        std::vector<Member> Members;
+    };
+
+    static constexpr size_t LinearMembers = 8;
+
+    // Frames above Depth are kept so their member lists keep their capacity
+    std::vector<Frame> Frames;
+    size_t Depth = 0;
+
+    // Keys that had escapes, decoded. A deque so the views into it stay valid.
+    std::deque<std::string> DecodedKeys;
+
+    // Indexes Text, which must stay alive while this is used. Throws on malformed input.
+    void Load(std::string_view Text);
+
+    inline void Reset(size_t MaxRetainedBytes) {
+        Document.Clear();
+        ClearRetained(Contents, MaxRetainedBytes);
+        BinaryBegin = 0;
+        NamedScopes::Scopes.clear();
+        Shared.Clear();
+        Mapping.reset();
+        MappedBinary = { };
+        Source.reset();
+        SourceBinaryOffset = 0;
+        InPlace = false;
+        Depth = 0;
+        DecodedKeys.clear();
+        if (Document.Capacity() > MaxRetainedBytes) Document = IndexedJSON();
+    }
+
+    inline std::span<const uint8_t> BinarySection() const {
+        return MappedBinary.data() ? MappedBinary : std::span<const uint8_t>(Contents).subspan(std::min(BinaryBegin, Contents.size()));
+    }
+
+    inline bool Has(std::string const& Name) {
+        uint32_t Prev;
+        return Find(Name, Prev);
+    }
+
+    // Value named Name in the current scope, false if there is none
+    bool Find(std::string const& Name, uint32_t& Prev);
+
+    inline uint32_t FindChecked(std::string const& Name) {
+        uint32_t Prev;
+        if (!Find(Name, Prev)) {
+            throw StreamTransferError { "Element named " + Name + " does not exist:\n" + DumpScopes() };
+        }
+        return Prev;
+    }
+
+    [[noreturn]] inline void WrongType(std::string const& Expected, std::string const& Name) {
+        throw StreamTransferError { "Wrong Type: expected " + Expected + " for " + Name + "\n" + DumpScopes() };
+    }
+
+    inline void DecodeString(uint32_t Prev, std::string const& Name, std::string& Out) {
+        if (Document.KindOf(Prev) != IndexedJSON::Kind::String) WrongType("a string", Name);
+        if (!IndexedJSON::Unescape(Document.RawString(Prev), Out)) WrongType("a valid string", Name);
+    }
+
+    // Same conversions as nlohmann's get<T>: fractions truncate into integers
+    // and out of range integers wrap
+    template<typename T>
+    inline T DecodeNumber(uint32_t Prev, std::string const& Name) {
+        if (Document.KindOf(Prev) != IndexedJSON::Kind::Number) WrongType("a number", Name);
+        std::string_view Text = Document.Scalar(Prev);
+        const char* End = Text.data() + Text.size();
+
+        if constexpr (std::is_integral<T>::value) {
+            if (Text[0] == '-') {
+                int64_t Res;
+                auto [Ptr, Ec] = std::from_chars(Text.data(), End, Res);
+                if (Ec == std::errc() && Ptr == End) return static_cast<T>(Res);
+            } else {
+                uint64_t Res;
+                auto [Ptr, Ec] = std::from_chars(Text.data(), End, Res);
+                if (Ec == std::errc() && Ptr == End) return static_cast<T>(Res);
+            }
+        }
+
+        double Res;
+        auto [Ptr, Ec] = std::from_chars(Text.data(), End, Res);
+        if (Ec != std::errc() || Ptr != End) WrongType("a valid number", Name);
+        return static_cast<T>(Res);
+    }
+
+    template<typename T>
+    requires (Primitive<T>)
+    inline void Decode(uint32_t Prev, std::string const& Name, T& Value) {
+        if constexpr (std::is_same<T, std::string>::value) {
+            DecodeString(Prev, Name, Value);
+        } else if constexpr (std::is_same<T, bool>::value) {
+            IndexedJSON::Kind Kind = Document.KindOf(Prev);
+            if (Kind != IndexedJSON::Kind::True && Kind != IndexedJSON::Kind::False) WrongType("a boolean", Name);
+            Value = Kind == IndexedJSON::Kind::True;
+        } else {
+            Value = DecodeNumber<T>(Prev, Name);
+        }
+    }
+
+    template<typename T>
+    requires (!Primitive<T> && !std::is_enum<T>::value)
+    inline T Consume(std::string const& Name) {
+        BeginScope(Name);
+        T Res;
+        Res.Receive(*this);
+        EndScope();
+        return Res;
+    }
+
+    template<typename T>
+    requires (Primitive<T>)
+    inline T Consume(std::string const& Name) {
+        T Res;
+        Decode(FindChecked(Name), Name, Res);
+        return Res;
+    }
+
+    template<typename T>
+    requires (std::is_enum<T>::value)
+    inline T Consume(std::string const& Name) {
+        return static_cast<T>(Consume<typename std::underlying_type<T>::type>(Name));
+    }
+
+    // Strings are decoded into Value's existing buffer even without InPlace,
+    // since that is never more expensive than building a new one
+    template<typename T>
+    inline void ConsumeInto(std::string const& Name, T& Value) {
+        if constexpr (Primitive<T>) {
+            Decode(FindChecked(Name), Name, Value);
+        } else if constexpr (std::is_enum<T>::value) {
+            Value = Consume<T>(Name);
+        } else if (!InPlace) {
+            Value = Consume<T>(Name);
+        } else {
+            BeginScope(Name);
+            Value.Receive(*this);
+            EndScope();
+        }
+    }
+
+    template<typename T>
+    inline void ConsumeCheck(std::string const& Name, const T& Value) {
+        if (Consume<T>(Name) != Value) {
+            throw StreamTransferError { "Checked consume did not match expected value:\n" + DumpScopes() };
+        }
+    }
+
+    inline void ConsumeBytes(std::string const& Name, std::vector<uint8_t>& Bytes) {
+        std::span<const uint8_t> Range = ViewBytes(Name);
+        Bytes.assign(Range.begin(), Range.end());
+    }
+
+    inline std::span<const uint8_t> ViewBytes(std::string const& Name) {
+        auto [Begin, End] = ConsumeByteRange(Name);
+        return BinarySection().subspan(Begin, End - Begin);
+    }
+
+    inline std::pair<size_t, size_t> ConsumeByteRange(std::string const& Name) {
+        size_t Begin = Consume<size_t>("Begin");
+        size_t End = Consume<size_t>("End");
+        std::span<const uint8_t> Section = BinarySection();
+
+        if (End < Begin || End > Section.size()) {
+            throw StreamTransferError { "Binary range was invalid:\n" + DumpScopes() };
+        }
+
+        return { Begin, End };
+    }
+
+    virtual void BeginScope(std::string const& Name) override;
+
+    inline virtual void EndScope() override {
+        --Depth;
+    }
+
+private:
+    Frame& PushFrame(IndexedJSON::Kind Kind, uint32_t Open);
+    void ListMembers(Frame& Top);
+};
+
+// Runs Send without building anything and computes the exact number of bytes
+// JSONSerializer would produce for the same value when dumped with Indent.
+struct SizeSerializer : public NamedScopes {
+    struct Frame {
+        size_t KeySize = 0;
+        size_t Members = 0;
+        size_t Content = 0;
+    };
+
+    int Indent;
+    size_t BinarySize = 0;
+
+    // Part of BinarySize that is streamed from files rather than held in memory
+    size_t ExternalSize = 0;
+
+    std::vector<Frame> Frames;
+
+    SharedSendTable Shared;
+
+    inline SizeSerializer(int Indent = -1)
+    : Indent(Indent) {
+        Frames.emplace_back();
+    }
+
+    static inline size_t QuotedSize(std::string const& Val) {
+        size_t Res = 2;
+        for (char C : Val) {
+            switch (C) {
+            case '\b': case '\t': case '\n': case '\f': case '\r': case '"': case '\\':
+                Res += 2;
+                break;
+            default:
+                Res += (static_cast<uint8_t>(C) <= 0x1F) ? 6 : 1;
+                break;
+            }
+        }
+        return Res;
+    }
+
+    template<typename T>
+    static inline size_t ValueSize(const T& Val) {
+        if constexpr (std::is_same<T, bool>::value) {
+            return Val ? 4 : 5;
+        } else if constexpr (std::is_same<T, std::string>::value) {
+            return QuotedSize(Val);
+        } else if constexpr (std::is_floating_point<T>::value) {
+            if (!std::isfinite(static_cast<double>(Val))) return 4;
+            std::array<char, 64> Chars;
+            return nlohmann::detail::to_chars(Chars.data(), Chars.data() + Chars.size(), static_cast<double>(Val)) - Chars.data();
+        } else {
+            size_t Res = 1;
+            uint64_t Magnitude;
+            if constexpr (std::is_signed<T>::value) {
+                Magnitude = Val < 0 ? 0 - static_cast<uint64_t>(Val) : static_cast<uint64_t>(Val);
+                Res += Val < 0 ? 1 : 0;
+            } else {
+                Magnitude = static_cast<uint64_t>(Val);
+            }
+            while (Magnitude >= 10) {
+                Magnitude /= 10;
+                ++Res;
+            }
+            return Res;
+        }
+    }
+
+    inline size_t ObjectSize(Frame const& F, size_t Depth) const {
+        if (F.Members == 0) return 4; // An untouched scope dumps as null
+
+        if (Indent < 0) return 2 + F.Content + (F.Members - 1);
+
+        size_t Step = static_cast<size_t>(Indent);
+        return 2 + F.Members * Step * (Depth + 1) + F.Content + 2 * (F.Members - 1) + 1 + Step * Depth + 1;
+    }
+
+    inline void AddMember(size_t KeySize, size_t Size) {
+        Frame& F = Frames.back();
+        F.Members++;
+        F.Content += KeySize + (Indent >= 0 ? 2 : 1) + Size;
+    }
+
+    template<typename T>
+    requires (!Primitive<T> && !std::is_enum<T>::value)
+    inline void Push(std::string const& Name, const T& Val) {
+        BeginScope(Name);
+        Val.Send(*this);
+        EndScope();
+    }
+
+    template<typename T>
+    requires (Primitive<T>)
+    inline void Push(std::string const& Name, const T& Val) {
+        AddMember(QuotedSize(Name), ValueSize(Val));
+    }
+
+    template<typename T>
+    requires (std::is_enum<T>::value)
+    inline void Push(std::string const& Name, const T& Val) {
+        AddMember(QuotedSize(Name), ValueSize(static_cast<typename std::underlying_type<T>::type>(Val)));
+    }
+
+    inline void PushBytes(std::string const& Name, std::span<const uint8_t> Bytes, size_t Alignment = 1) {
+        BinarySize = AlignUp(BinarySize, Alignment);
+        AddMember(QuotedSize("Begin"), ValueSize(BinarySize));
+        AddMember(QuotedSize("End"), ValueSize(BinarySize + Bytes.size()));
+        BinarySize += Bytes.size();
+    }
+
+    inline void PushFileRange(std::string const& Name, std::shared_ptr<FileHandle> const& File, uint64_t Offset, uint64_t Length) {
+        AddMember(QuotedSize("Begin"), ValueSize(BinarySize));
+        AddMember(QuotedSize("End"), ValueSize(BinarySize + Length));
+        BinarySize += Length;
+        ExternalSize += Length;
+    }
+
+    inline virtual void BeginScope(std::string const& Name) override {
+        Frames.emplace_back();
+        Frames.back().KeySize = QuotedSize(Name);
+    }
+    inline virtual void EndScope() override {
+        size_t Size = ObjectSize(Frames.back(), Frames.size() - 1);
+        size_t KeySize = Frames.back().KeySize;
+        Frames.pop_back();
+        AddMember(KeySize, Size);
+    }
+
+    // Size of the JSON text, excluding the terminator
+    inline size_t TextSize() const {
+        return ObjectSize(Frames.front(), 0);
+    }
+
+    // Size of the JSON text plus its terminator, padded so the binary section is aligned
+    inline size_t HeaderSize() const {
+        return BinarySize == 0 ? TextSize() + 1 : AlignUp(TextSize() + 1, BinaryAlignment);
+    }
+
+    // Size of the whole file: padded JSON text, terminator and binary section
+    inline size_t TotalSize() const {
+        return HeaderSize() + BinarySize;
+    }
+};
+
+// Per-thread free list of serializers. Released instances are reset but keep
+// the capacity of their buffers and scope stacks, so hot paths like Hash stop
+// allocating once warm.
+template<typename T>
+class TransferPool {
+public:
+    static constexpr size_t MaxPooled = 8;
+    static constexpr size_t MaxRetainedBytes = 16 * 1024 * 1024;
+
+    class Handle {
+        std::unique_ptr<T> Value;
+
+    public:
+        inline Handle(std::unique_ptr<T> Value)
+        : Value(std::move(Value)) { }
+
+        Handle(Handle&&) = default;
+        Handle& operator=(Handle&&) = default;
+
+        inline ~Handle() {
+            if (Value) TransferPool::Release(std::move(Value));
+        }
+
+        T& operator*() { return *Value; }
+        T* operator->() { return Value.get(); }
+    };
+
+    static inline Handle Acquire() {
+        std::vector<std::unique_ptr<T>>& Free = FreeList();
+        if (Free.empty()) {
+            return Handle(std::make_unique<T>());
+        }
+        std::unique_ptr<T> Res = std::move(Free.back());
+        Free.pop_back();
+        return Handle(std::move(Res));
+    }
+
+private:
+    static inline std::vector<std::unique_ptr<T>>& FreeList() {
+        thread_local std::vector<std::unique_ptr<T>> Free;
+        return Free;
+    }
+
+    static inline void Release(std::unique_ptr<T> Value) {
+        std::vector<std::unique_ptr<T>>& Free = FreeList();
+        if (Free.size() >= MaxPooled) return;
+        Value->Reset(MaxRetainedBytes);
+        Free.push_back(std::move(Value));
+    }
+};
+
+uint64_t HashCb(std::function<void(JSONSerializer&)> const& Func);
+
+// Merkle tree over per-element hashes. Elements are grouped into chunks of
+// ChunkSize, and chunk hashes are combined pairwise up to a single root, so
+// changing or appending one element only recomputes its chunk and O(log n)
+// ancestors.
+class HashTree {
+public:
+    static constexpr size_t ChunkSize = 32;
+
+    inline size_t Size() const { return Leaves.size(); }
+
+    // Drops trailing elements or appends zeroed ones
+    void Resize(size_t Count);
+
+    void Set(size_t Index, uint64_t ElementHash);
+
+    // Brings dirty chunks and their ancestors up to date
+    uint64_t Root();
+
+private:
+    std::vector<uint64_t> Leaves;
+    std::vector<uint64_t> Nodes;
+    std::vector<size_t> Dirty;
+    size_t Width = 0;
+
+    void MarkDirty(size_t Chunk);
+};
+
 
 #define BeginTransferStruct(Name) struct Name { private: static constexpr const char StructName[] = #Name; public:
 #define BeginStructBased(Name, BaseName) struct Name : public BaseName { private: static constexpr const char StructName[] = #Name; public:
@@ -251,6 +988,169 @@ BeginTransferStruct(Buffer)
     EndSend()
 EndStruct()
 
+// Buffer whose bytes stay in a range of a file. Writing streams the range
+// into the output with kernel-side copies, and reading gives back a range
+// into the loaded file without touching the payload. The range keeps its
+// file open, so it stays valid even if the file is replaced on disk.
+BeginTransferStruct(FileRange)
+    std::shared_ptr<FileHandle> File;
+    uint64_t Offset = 0;
+    uint64_t Length = 0;
+
+    FileRange() = default;
+
+    // The whole file at Path
+    inline FileRange(std::string const& Path)
+    : File(FileHandle::Open(Path)) {
+        if (!File) throw StreamTransferError { "Could not open " + Path + "\n" };
+        Length = File->Size();
+    }
+
+    inline FileRange(std::string const& Path, uint64_t Offset, uint64_t Length)
+    : File(FileHandle::Open(Path)), Offset(Offset), Length(Length) {
+        if (!File) throw StreamTransferError { "Could not open " + Path + "\n" };
+    }
+
+    // Loads the payload
+    std::vector<uint8_t> Read() const {
+        std::vector<uint8_t> Res(Length);
+        if (Length != 0 && (!File || !File->ReadAt(Offset, Res))) {
+            throw StreamTransferError { "File range could not be read\n" };
+        }
+        return Res;
+    }
+
+    std::string GetString() const {
+        std::vector<uint8_t> Bytes = Read();
+        return std::string(Bytes.begin(), Bytes.end());
+    }
+
+    BeginSend(Ctx)
+        Ctx.PushFileRange("Data", File, Offset, Length);
+    EndSend()
+
+    BeginReceive(Ctx)
+        if constexpr (requires { Ctx.Source; }) {
+            if (Ctx.Source) {
+                auto [Begin, End] = Ctx.ConsumeByteRange("Data");
+                File = Ctx.Source;
+                Offset = Ctx.SourceBinaryOffset + Begin;
+                Length = End - Begin;
+                return;
+            }
+        }
+
+        // Not read from a file, spill the bytes into a temporary one
+        std::span<const uint8_t> Bytes = Ctx.ViewBytes("Data");
+        File = FileHandle::Temporary(Bytes);
+        if (!File) {
+            throw StreamTransferError { "Could not spill file range to a temporary file:\n" + Ctx.DumpScopes() };
+        }
+        Offset = 0;
+        Length = Bytes.size();
+    EndSend()
+EndStruct()
+
+template<typename T>
+requires (std::is_arithmetic<T>::value)
+inline std::string ElementTypeName() {
+    if constexpr (std::is_same<T, bool>::value) {
+        return "b8";
+    } else if constexpr (std::is_floating_point<T>::value) {
+        return "f" + std::to_string(sizeof(T) * 8);
+    } else {
+        return (std::is_signed<T>::value ? "i" : "u") + std::to_string(sizeof(T) * 8);
+    }
+}
+
+// Array of arithmetic values stored BinaryAlignment-aligned in the binary
+// section along with its element type and count. When loaded from a mapped
+// file it views the mapping directly, otherwise it owns an aligned copy.
+template<typename T>
+requires (std::is_arithmetic<T>::value)
+BeginTransferStruct(TypedBuffer)
+    using Storage = std::vector<T, AlignedAllocator<T>>;
+
+    TypedBuffer() = default;
+    inline TypedBuffer(std::span<const T> Values) {
+        Assign(Values);
+    }
+
+    std::span<const T> View() const { return Keep ? Mapped : std::span<const T>(Owned); }
+
+    size_t size() const { return View().size(); }
+    bool empty() const { return View().empty(); }
+    const T* data() const { return View().data(); }
+    T const& operator[](size_t Index) const { return View()[Index]; }
+    auto begin() const { return View().begin(); }
+    auto end() const { return View().end(); }
+
+    // Whether the elements are viewed from a mapped file rather than owned
+    bool IsMapped() const { return Keep != nullptr; }
+
+    void Assign(std::span<const T> Values) {
+        Storage Copy(Values.begin(), Values.end());
+        Owned = std::move(Copy);
+        Release();
+    }
+
+    // Owned, writable elements. Copies out of the mapping first if needed.
+    Storage& Mutable() {
+        if (Keep) {
+            Owned.assign(Mapped.begin(), Mapped.end());
+            Release();
+        }
+        return Owned;
+    }
+
+    BeginSend(Ctx)
+        std::span<const T> Values = View();
+        Ctx.template Push("Type", ElementTypeName<T>());
+        Ctx.template Push("Count", Values.size());
+        Ctx.PushBytes("Data", std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(Values.data()), Values.size_bytes()), BinaryAlignment);
+    EndSend()
+
+    BeginReceive(Ctx)
+        std::string Type = Ctx.template Consume<std::string>("Type");
+        if (Type != ElementTypeName<T>()) {
+            throw StreamTransferError { "Typed buffer holds " + Type + ", expected " + ElementTypeName<T>() + ":\n" + Ctx.DumpScopes() };
+        }
+
+        size_t Count = Ctx.template Consume<size_t>("Count");
+        std::span<const uint8_t> Bytes = Ctx.ViewBytes("Data");
+        if (Bytes.size() != Count * sizeof(T)) {
+            throw StreamTransferError { "Typed buffer size does not match its count:\n" + Ctx.DumpScopes() };
+        }
+
+        const T* Values = reinterpret_cast<const T*>(Bytes.data());
+        bool Aligned = reinterpret_cast<uintptr_t>(Bytes.data()) % alignof(T) == 0;
+
+        if constexpr (requires { Ctx.Mapping; }) {
+            if (Ctx.Mapping && Aligned) {
+                Owned = Storage();
+                Keep = Ctx.Mapping;
+                Mapped = std::span<const T>(Values, Count);
+                return;
+            }
+        }
+
+        Release();
+        Owned.resize(Count);
+        if (Count != 0) memcpy(Owned.data(), Bytes.data(), Bytes.size());
+    EndSend()
+
+private:
+    Storage Owned;
+    std::shared_ptr<const void> Keep;
+    std::span<const T> Mapped;
+
+    void Release() {
+        Keep.reset();
+        Mapped = { };
+    }
+public:
+EndStruct()
+
 template<typename T>
 BeginTransferStruct(Vector)
     std::vector<T> Data;
@@ -261,17 +1161,89 @@ BeginTransferStruct(Vector)
     decltype(((const std::vector<T>&)Data).begin()) begin() const { return Data.begin(); }
     decltype(((const std::vector<T>&)Data).end()) end() const { return Data.end(); }
 
-    void erase(typename std::vector<T>::iterator const& it) { Data.erase(it); }
+    void erase(typename std::vector<T>::iterator const& it) {
+        Truncated(it - Data.begin());
+        Data.erase(it);
+    }
+
+    // Incremental hashing. Once enabled, Hash uses a Merkle root over the
+    // elements instead of their full contents. Size changes are picked up
+    // automatically, but elements edited in place must go through Modify or
+    // Touch, otherwise their old hash is kept. A FileBacked holding such edits
+    // must be told with MarkUntrackedEdits, or Flush will not see them.
+    void TrackHashes(bool Enable = true) {
+        Incremental = Enable;
+        Merkle = HashTree();
+        Touched.clear();
+    }
+
+    bool TracksHashes() const { return Incremental; }
+
+    void push_back(T const& Val) { Data.push_back(Val); }
+    void push_back(T&& Val) { Data.push_back(std::move(Val)); }
+
+    T& Modify(size_t Index) {
+        Touch(Index);
+        return Data[Index];
+    }
+
+    void Touch(size_t Index) {
+        if (Incremental && Index < Merkle.Size()) Touched.push_back(Index);
+    }
+
+    uint64_t RootHash() const {
+        if (Data.size() < Merkle.Size()) {
+            Merkle.Resize(Data.size());
+        }
+        for (size_t Index : Touched) {
+            if (Index < Merkle.Size()) Merkle.Set(Index, HashElement(Data[Index]));
+        }
+        Touched.clear();
+
+        size_t Known = Merkle.Size();
+        Merkle.Resize(Data.size());
+        for (size_t i = Known; i < Data.size(); ++i) {
+            Merkle.Set(i, HashElement(Data[i]));
+        }
+        return Merkle.Root();
+    }
 
     BeginSend(Ctx)
-        Ctx.template Push("Size", Data.size());
+        if constexpr (requires { Ctx.Hashing; }) {
+            if (Ctx.Hashing && Incremental) {
+                Ctx.template Push("Size", Data.size());
+                Ctx.template Push("Root", RootHash());
+                return;
+            }
+        }
+
+        // Size goes last, beside the elements that change when it does. Files
+        // are unaffected since members are written sorted by name.
         for (size_t i = 0; i < Data.size(); ++i) {
             Ctx.template Push(std::to_string(i), Data[i]);
         }
+        Ctx.template Push("Size", Data.size());
     EndSend()
 
     BeginReceive(Ctx)
         size_t Size = Ctx.template Consume<size_t>("Size");
+        Truncated(0);
+
+        if constexpr (requires { Ctx.InPlace; }) {
+            if (Ctx.InPlace) {
+                Data.resize(Size);
+                for (size_t i = 0; i < Size; ++i) {
+                    try {
+                        Ctx.template ConsumeInto(std::to_string(i), Data[i]);
+                    } catch (StreamTransferError& Err) {
+                        Err.Message += "Receiving element " + std::to_string(i) + " of " + std::to_string(Size) + "\n";
+                        throw;
+                    }
+                }
+                return;
+            }
+        }
+
         Data.resize(0);
         Data.reserve(Size);
         for (size_t i = 0; i < Size; ++i) {
@@ -279,6 +1251,24 @@ BeginTransferStruct(Vector)
             Data.push_back(Ctx.template Consume<T>(std::to_string(i)));
         }
     EndSend()
+
+private:
+    bool Incremental = false;
+    mutable HashTree Merkle;
+    mutable std::vector<size_t> Touched;
+
+    // Elements from Index on no longer match their cached hashes
+    void Truncated(size_t Index) {
+        if (Incremental && Index < Merkle.Size()) Merkle.Resize(Index);
+    }
+
+    static uint64_t HashElement(T const& Element) {
+        return HashCb([&Element](JSONSerializer& Ser) {
+            Ser.Hashing = true;
+            Ser.Push("Element", Element);
+        });
+    }
+public:
 EndStruct()
 
 template<typename T>
@@ -296,8 +1286,121 @@ BeginTransferStruct(Optional)
     EndSend()
 
     BeginReceive(Ctx)
-        if (Ctx.AtChecked("ExistingOptional") != nullptr) {
-            Value = Ctx.template Consume<T>("ExistingOptional");
+        if (Ctx.Has("ExistingOptional")) {
+            if (!Value) Value.emplace();
+            Ctx.template ConsumeInto("ExistingOptional", *Value);
+        } else {
+            Value.reset();
+        }
+    EndSend()
+EndStruct()
+
+// Reference to an object that may be shared by several owners. Each distinct
+// object is written once per serializer, later references store only its id,
+// and receiving rebuilds the same sharing (including cycles).
+template<typename T>
+BeginTransferStruct(Shared)
+    std::shared_ptr<T> Value;
+
+    Shared() = default;
+    inline Shared(std::shared_ptr<T> Value)
+    : Value(std::move(Value)) { }
+
+    template<typename... ArgTs>
+    static inline Shared Make(ArgTs&&... Args) {
+        return Shared(std::make_shared<T>(std::forward<ArgTs>(Args)...));
+    }
+
+    T* get() const { return Value.get(); }
+    T& operator*() const { return *Value; }
+    T* operator->() const { return Value.get(); }
+    explicit operator bool() const { return Value != nullptr; }
+
+    BeginSend(Ctx)
+        if (!Value) {
+            Ctx.template Push("Id", uint64_t(0));
+            return;
+        }
+
+        bool First;
+        uint64_t Id = Ctx.Shared.Assign(Value.get(), First);
+        Ctx.template Push("Id", Id);
+        if (First) {
+            Ctx.template Push("Value", *Value);
+        }
+    EndSend()
+
+    BeginReceive(Ctx)
+        uint64_t Id = Ctx.template Consume<uint64_t>("Id");
+        if (Id == 0) {
+            Value.reset();
+            return;
+        }
+
+        Value = Ctx.Shared.template Find<T>(Id);
+        if (Value) return;
+
+        if (!Ctx.Has("Value")) {
+            throw StreamTransferError { "Shared object " + std::to_string(Id) + " referenced before it was defined:\n" + Ctx.DumpScopes() };
+        }
+
+        // Registered before receiving so references back to it resolve to the same object
+        Value = std::make_shared<T>();
+        Ctx.Shared.Add(Id, Value);
+        if constexpr (Primitive<T> || std::is_enum<T>::value) {
+            *Value = Ctx.template Consume<T>("Value");
+        } else {
+            Ctx.BeginScope("Value");
+            Value->Receive(Ctx);
+            Ctx.EndScope();
+        }
+    EndSend()
+EndStruct()
+
+// Single-owner, nullable counterpart of Shared<T>. Always written inline and
+// copied deeply, so it keeps tree semantics while allowing recursive types.
+template<typename T>
+BeginTransferStruct(Unique)
+    std::unique_ptr<T> Value;
+
+    Unique() = default;
+    inline Unique(std::unique_ptr<T> Value)
+    : Value(std::move(Value)) { }
+
+    inline Unique(Unique const& Rhs)
+    : Value(Rhs.Value ? std::make_unique<T>(*Rhs.Value) : nullptr) { }
+
+    Unique(Unique&&) = default;
+
+    inline Unique& operator=(Unique const& Rhs) {
+        Value = Rhs.Value ? std::make_unique<T>(*Rhs.Value) : nullptr;
+        return *this;
+    }
+
+    Unique& operator=(Unique&&) = default;
+
+    template<typename... ArgTs>
+    static inline Unique Make(ArgTs&&... Args) {
+        return Unique(std::make_unique<T>(std::forward<ArgTs>(Args)...));
+    }
+
+    T* get() const { return Value.get(); }
+    T& operator*() const { return *Value; }
+    T* operator->() const { return Value.get(); }
+    explicit operator bool() const { return Value != nullptr; }
+
+    BeginSend(Ctx)
+        if (Value) {
+            Ctx.template Push("Value", *Value);
+        }
+    EndSend()
+
+    BeginReceive(Ctx)
+        if (Ctx.Has("Value")) {
+            if (!Value) Value = std::make_unique<T>();
+            Ctx.template ConsumeInto("Value", *Value);
+        } else {
+            Value.reset();
         }
     EndSend()
 EndStruct()
@@ -317,18 +1420,93 @@ BeginTransferStruct(Array)
         Ctx.template ConsumeCheck<size_t>("Size", N);
         for (size_t i = 0; i < N; ++i) {
             StreamScope Scope(Ctx, "Receiving element " + std::to_string(i) + " of " + std::to_string(N));
-            Data[i] = Ctx.template Consume<T>(std::to_string(i));
+            Ctx.template ConsumeInto(std::to_string(i), Data[i]);
         }
     EndSend()
 EndStruct()
 
 bool ReadFileJSONCb(std::string const& Path, std::function<void(JSONDeserializer&)> const& Func);
 
-void WriteFileJSONCb(std::string const& Path, std::function<void(JSONSerializer&)> const& Func);
+// Same as ReadFileJSONCb but through the structural index, see IndexedDeserializer.
+// With Log, the latest contents it holds for Path are read in place of the file.
+bool ReadFileIndexedCb(std::string const& Path, std::function<void(IndexedDeserializer&)> const& Func, Journal const* Log = nullptr);
+
+// Files larger than this are memory mapped rather than read
+constexpr size_t MapThreshold = 256 * 1024;
+
+// Where a Vector's elements sit inside a saved file, found by scanning the
+// JSON text without decoding anything. Elements are then decoded one at a
+// time straight from the mapped file.
+struct StoredVector {
+    std::shared_ptr<MappedFile> Mapping;
+    std::shared_ptr<FileHandle> Source;
+    uint64_t BinaryOffset = 0;
+
+    // Begin and end of each element's JSON text, in index order
+    std::vector<std::pair<size_t, size_t>> Elements;
+
+    // Scope names the members leading from the top level to the Vector, empty
+    // when the file is the Vector itself. A missing or empty file gives no elements.
+    static StoredVector Open(std::string const& Path, std::vector<std::string> const& Scope = { });
+
+    // Loads element Index into Deser as the value named "Element"
+    void Prepare(JSONDeserializer& Deser, size_t Index) const;
+};
+
+// Yields the elements of a Vector<T> saved at Path one at a time, so peak
+// memory is bounded by a single element rather than the whole vector
+template<typename T>
+Generator<T> StreamVectorFile(std::string Path, std::vector<std::string> Scope = { }) {
+    StoredVector Stored = StoredVector::Open(Path, Scope);
+    for (size_t i = 0; i < Stored.Elements.size(); ++i) {
+        T Element;
+        {
+            TransferPool<JSONDeserializer>::Handle Deser = TransferPool<JSONDeserializer>::Acquire();
+            Stored.Prepare(*Deser, i);
+            StreamScope Context(*Deser, "Streaming element " + std::to_string(i) + " of " + Path);
+            Element = Deser->template Consume<T>("Element");
+        }
+        co_yield Element;
+    }
+}
+
+// Dumps Ser's text into Ser.Text, padded so the binary section after it is aligned, and null terminated
+void FinishText(JSONSerializer& Ser, size_t HeaderSizeHint = 0);
+
+// Writes a file range to Fd, without passing it through user space where the kernel allows
+bool CopyRange(int Fd, ExternalRange const& Range);
+
+// Writes Ser's binary section to Fd, streaming external ranges with kernel-side copies
+bool WriteBinarySection(int Fd, JSONSerializer const& Ser);
+
+// Writes to a temporary file that then replaces Path, false if that failed.
+// HeaderSizeHint, when known, is used to reserve the output text in one allocation.
+bool WriteFileJSONCb(std::string const& Path, std::function<void(JSONSerializer&)> const& Func, size_t HeaderSizeHint = 0);
+
+// Outcome of one file in a bulk load
+struct FileLoadStatus {
+    std::string Path;
 
+    // False when the file could not be opened or read
+    bool Found = false;
+
+    // Set when the file was found but could not be decoded
+    std::string Error;
+
+    bool Ok() const { return Found && Error.empty(); }
+};
+
+// Reads every path with ReadFileIndexedCb across up to Workers threads, zero
+// meaning one per core. Func gets the index of the path being decoded and may
+// run concurrently for different indices. Errors are reported per file
+// rather than thrown. Logs, when not empty, holds the journal for each path.
+std::vector<FileLoadStatus> ReadFilesIndexedCb(std::span<const std::string> Paths, std::function<void(size_t, IndexedDeserializer&)> const& Func, size_t Workers = 0, std::span<Journal const* const> Logs = { });
+
+// With InPlace, Value is decoded into rather than rebuilt, see JSONDeserializer::InPlace
 template<typename T>
-inline bool ReadFileJSON(std::string const& Path, T& Value) {
-    return ReadFileJSONCb(Path, [&Value](JSONDeserializer& Deser) {
+inline bool ReadFileJSON(std::string const& Path, T& Value, bool InPlace = false) {
+    return ReadFileIndexedCb(Path, [&Value, InPlace](IndexedDeserializer& Deser) {
+        Deser.InPlace = InPlace;
         Value.Receive(Deser);
     });
 }
@@ -336,33 +1514,71 @@ inline bool ReadFileJSON(std::string const& Path, T& Value) {
 template<typename T>
 inline T ReadFileJSONDefault(std::string const& Path) {
     T Res;
-    ReadFileJSONCb(Path, [&Res](JSONDeserializer& Deser) {
+    ReadFileIndexedCb(Path, [&Res](IndexedDeserializer& Deser) {
         Res.Receive(Deser);
     });
     return Res;
 }
 
+// Bulk ReadFileJSON, loading Paths[i] into Values[i] in parallel
 template<typename T>
-inline void WriteFileJSON(std::string const& Path, T& Value) {
-    WriteFileJSONCb(Path, [&Value](JSONSerializer& Ser) {
+inline std::vector<FileLoadStatus> ReadFilesJSON(std::span<const std::string> Paths, std::span<T> Values, bool InPlace = false, size_t Workers = 0) {
+    if (Paths.size() != Values.size()) {
+        throw StreamTransferError { "Bulk load given " + std::to_string(Paths.size()) + " paths for " + std::to_string(Values.size()) + " values\n" };
+    }
+    return ReadFilesIndexedCb(Paths, [Values, InPlace](size_t Index, IndexedDeserializer& Deser) {
+        Deser.InPlace = InPlace;
+        Values[Index].Receive(Deser);
+    }, Workers);
+}
+
+// The bytes WriteFileJSONCb would write to a file, with file ranges read in
+std::vector<uint8_t> EncodeFileJSONCb(std::function<void(JSONSerializer&)> const& Func, size_t HeaderSizeHint = 0);
+
+// Exact size of the file WriteFileJSON would produce, without encoding anything
+template<typename T>
+inline SizeSerializer EncodedSize(T const& Value, int Indent = 2) {
+    SizeSerializer Sizer(Indent);
+    Value.Send(Sizer);
+    return Sizer;
+}
+
+template<typename T>
+inline bool WriteFileJSON(std::string const& Path, T& Value) {
+    SizeSerializer Sizer = EncodedSize(Value);
+    return WriteFileJSONCb(Path, [&Value, &Sizer](JSONSerializer& Ser) {
+        Ser.Binary.reserve(Sizer.BinarySize - Sizer.ExternalSize);
         Value.Send(Ser);
-    });
+    }, Sizer.HeaderSize());
 }
 
-uint64_t HashCb(std::function<void(JSONSerializer&)> const& Func);
+template<typename T>
+inline std::vector<uint8_t> EncodeFileJSON(T const& Value) {
+    SizeSerializer Sizer = EncodedSize(Value);
+    return EncodeFileJSONCb([&Value, &Sizer](JSONSerializer& Ser) {
+        Ser.Binary.reserve(Sizer.BinarySize - Sizer.ExternalSize);
+        Value.Send(Ser);
+    }, Sizer.HeaderSize());
+}
 
+// Hash of Value's serialized form. Types that track hashes incrementally,
+// such as Vector after TrackHashes, contribute their cached root instead.
 template<typename T>
-uint64_t Hash(T& Value) {
+uint64_t Hash(T const& Value) {
     return HashCb([&Value](JSONSerializer& Ser) {
+        Ser.Hashing = true;
         Value.Send(Ser);
     });
 }
 
 template<typename T>
-bool IsEqual(T& Lhs, T& Rhs) {
+bool IsEqual(T const& Lhs, T const& Rhs) {
     return Hash(Lhs) == Hash(Rhs);
 }
 
+// Tag for constructing a FileBacked without reading it yet
+struct DeferLoad { };
+
 template<typename T>
 class FileBacked {
 public:
@@ -370,8 +1586,10 @@ public:
 
     T Value;
 
+    // Also the way to overwrite a file that failed to load
     void operator=(T const& Rhs) {
         Value = Rhs;
+        LoadError = false;
     }
 
     T* operator->() {
@@ -382,16 +1600,120 @@ public:
         return &Value;
     }
 
-    inline FileBacked(std::filesystem::path const& Path)
-    : Path(Path) {
-        ReadFileJSON(Path, Value);
+    // With Log, every Flush goes through it, which makes it durable and writes
+    // Path at its next checkpoint. Reads then see what Log holds for Path
+    // first, as that is newer than the file until the checkpoint.
+    inline FileBacked(std::filesystem::path const& Path, std::shared_ptr<Journal> Log = nullptr)
+    : Path(Path), Log(std::move(Log)) {
+        if (Read(false)) {
+            MarkStored();
+        }
     }
 
-    void Flush() const {
-        WriteFileJSON(Path, const_cast<T&>(Value));
+    // Leaves Value default until LoadAll or Reload reads it
+    inline FileBacked(std::filesystem::path const& Path, DeferLoad, std::shared_ptr<Journal> Log = nullptr)
+    : Path(Path), Log(std::move(Log)) { }
+
+    // Reads many deferred FileBacked objects in parallel, see ReadFilesIndexedCb.
+    // A file that fails to decode leaves its Value default and is marked
+    // LoadFailed, so it is never written over until a value is assigned.
+    static std::vector<FileLoadStatus> LoadAll(std::span<FileBacked* const> Files, size_t Workers = 0) {
+        std::vector<std::string> Paths;
+        std::vector<Journal const*> Logs;
+        Paths.reserve(Files.size());
+        Logs.reserve(Files.size());
+        for (FileBacked* File : Files) {
+            Paths.push_back(File->Path.string());
+            Logs.push_back(File->Log.get());
+        }
+
+        std::vector<FileLoadStatus> Res = ReadFilesIndexedCb(Paths, [Files](size_t Index, IndexedDeserializer& Deser) {
+            FileBacked& File = *Files[Index];
+            T Loaded;
+            Loaded.Receive(Deser);
+            File.Value = std::move(Loaded);
+            File.MarkStored();
+        }, Workers, Logs);
+
+        for (size_t i = 0; i < Files.size(); ++i) {
+            Files[i]->LoadError = Res[i].Found && !Res[i].Ok();
+        }
+        return Res;
+    }
+
+    // Rereads Path, or the journal's newer contents for it, into the existing
+    // Value, reusing its allocations. Returns false and leaves Value alone if
+    // the file does not exist.
+    bool Reload() {
+        if (!Read(true)) return false;
+        MarkStored();
+        LoadError = false;
+        return true;
+    }
+
+    // Hash of the contents last read from or written to Path
+    std::optional<uint64_t> GetStoredHash() const {
+        return StoredHash;
+    }
+
+    // Cheap with cached hashes, see MarkUntrackedEdits
+    bool IsDirty() const {
+        return Untracked || !StoredHash || Hash(Value) != *StoredHash;
+    }
+
+    // Flush and IsDirty trust the cached hashes of Vectors that track them,
+    // so elements edited straight through Vector::Data rather than Modify or
+    // Touch go unseen. After such edits call this; the next Flush then writes
+    // whatever the hash says.
+    void MarkUntrackedEdits() {
+        Untracked = true;
+    }
+
+    // Path exists but LoadAll could not decode it. Flush leaves it alone until
+    // a value is assigned or Reload succeeds.
+    bool LoadFailed() const {
+        return LoadError;
+    }
+
+    // Writes Value unless it still matches what is on disk, false if the write
+    // failed or the file failed to load
+    bool Flush() const {
+        if (LoadError) return false;
+
+        uint64_t NewHash = Hash(Value);
+        if (!Untracked && StoredHash == NewHash) return true;
+
+        if (Log) {
+            if (!Log->Commit(Path.string(), EncodeFileJSON(Value))) return false;
+        } else if (!WriteFileJSON(Path, const_cast<T&>(Value))) {
+            return false;
+        }
+        StoredHash = NewHash;
+        Untracked = false;
+        return true;
     }
 
     ~FileBacked() {
         Flush();
     }
+
+private:
+    mutable std::optional<uint64_t> StoredHash;
+    mutable bool Untracked = false;
+
+    bool LoadError = false;
+    std::shared_ptr<Journal> Log;
+
+    bool Read(bool InPlace) {
+        return ReadFileIndexedCb(Path.string(), [this, InPlace](IndexedDeserializer& Deser) {
+            Deser.InPlace = InPlace;
+            Value.Receive(Deser);
+        }, Log.get());
+    }
+
+    // Records Value as what Path now holds
+    void MarkStored() {
+        StoredHash = Hash(Value);
+        Untracked = false;
+    }
 };
\ No newline at end of file
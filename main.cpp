@@ -6,13 +6,13 @@
 #include <sstream>
 #include <fstream>
 #include <thread>
+#include <future>
 #include <algorithm> 
 #include <cctype>
 #include <locale>
 #include <algorithm>
 
-#include <curl/curl.h>
-
+#include "OpenAI.hpp"
 #include "Transfer.hpp"
 
 using std::string;
@@ -73,104 +73,6 @@ std::vector<uint8_t> exec(const char* cmd) {
     return result;
 }
 
-std::string read_entire_file(const std::string &filename) {
-  std::ifstream file(filename);
-
-  if (!file.is_open()) {
-    return std::string();
-  }
-
-  std::stringstream stream;
-  stream << file.rdbuf();
-
-  file.close();
-
-  return stream.str();
-}
-
-class OpenAI {
-public:
-    static size_t WriteCallback(void *contents, size_t size, size_t nmemb, void *userp)
-    {
-        ((std::string*)userp)->append((char*)contents, size * nmemb);
-        return size * nmemb;
-    }
-
-    static string CurlRequest(string const& URL, std::vector<string> const& Headers, string const& PostData) {
-        CURL *curl;
-        CURLcode res;
-        std::string readBuffer;
-
-        curl = curl_easy_init();
-        if(curl) {
-            curl_easy_setopt(curl, CURLOPT_URL, URL.c_str());
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &readBuffer);
-
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, PostData.c_str());
-            
-            struct curl_slist *chunk = NULL;
-            for (string const& Header : Headers) {
-                chunk = curl_slist_append(chunk, Header.c_str());
-            }
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, chunk);
-
-            res = curl_easy_perform(curl);
-            curl_easy_cleanup(curl);
-            curl_slist_free_all(chunk);
-
-            return readBuffer;
-        }
-        return "";
-    }
-
-    static string Request(string Text, string Stop, size_t MaxTokens, double Temperature) {
-        if (MaxTokens > 100) MaxTokens = 100;
-
-        Vector<string> RequestLog = ReadFileJSONDefault<Vector<string>>("RequestLog.json");
-
-        string Key = read_entire_file("../openai-key.txt");
-
-        nlohmann::json Request = {
-            {"model", "text-davinci-003"},
-            {"prompt", Text },
-            {"temperature", Temperature},
-            {"max_tokens", MaxTokens }
-        };
-
-        if (!Stop.empty()) {
-            Request["stop"] = Stop;
-        }
-
-        string Res = CurlRequest(
-            "https://api.openai.com/v1/completions",
-            {
-                string("Content-Type: application/json"),
-                "Authorization: Bearer " + Key
-            },
-            Request.dump()
-        );
-
-        nlohmann::json Parsed;
-
-        try {
-            Parsed = nlohmann::json::parse(Res);
-        } catch (nlohmann::json::parse_error er) {
-            std::cout << "Result Parse Failed!\n" << Res << "\n\n";
-            return "";
-        }
-
-        try {
-            string Res = Parsed["choices"][0]["text"].get<string>();
-            RequestLog.Data.push_back(Text + Res);
-            WriteFileJSON("RequestLog.json", RequestLog);
-            return Res;
-        } catch (nlohmann::json::type_error er) {
-            return Parsed.dump(4);
-        }
-    }
-};
-
 BeginTransferStruct(Object)
     string Name;
     string Description;
@@ -229,17 +131,14 @@ BeginTransferStruct(Conversation)
         Entries.Data.push_back(Entry { Characters.Data[CharacterIndex].Name, Text });
     }
 
-    string CompleteCharacterEntry(int CharacterIndex, int TokenCount = 32) {
+    // OnToken, if set, sees the reply as it streams in, on the request thread.
+    // The entry is only added once the whole reply has arrived.
+    string CompleteCharacterEntry(int CharacterIndex, int TokenCount = 32, std::function<void(std::string_view)> OnToken = nullptr) {
         if (CharacterIndex < 0 || CharacterIndex >= Characters.Data.size()) {
             return "";
         }
 
-        string Query
-        = CharacterDescriptions() + "\n\n"
-        + ConversationText() + "\n"
-        + Characters.Data[CharacterIndex].Name + ": \"";
-
-        string Res = OpenAI::Request(Query, "\"", TokenCount, 1.0);
+        string Res = OpenAI::Request(CharacterEntryText(CharacterIndex), "\"", TokenCount, 1.0, CompletionOptions { OnToken });
 
         if (!Res.empty()) {
             AddEntry(CharacterIndex, Res);
@@ -248,8 +147,63 @@ BeginTransferStruct(Conversation)
         return Res;
     }
 
+    // As CompleteCharacterEntry, suspending instead of blocking. The
+    // conversation must outlive the task and not change while it waits.
+    Task<string> CompleteCharacterEntryTask(int CharacterIndex, int TokenCount = 32, std::function<void(std::string_view)> OnToken = nullptr) {
+        if (CharacterIndex < 0 || CharacterIndex >= Characters.Data.size()) {
+            co_return "";
+        }
+
+        string Res = co_await OpenAI::RequestTask(CharacterEntryText(CharacterIndex), "\"", TokenCount, 1.0, CompletionOptions { OnToken });
+
+        if (!Res.empty()) {
+            AddEntry(CharacterIndex, Res);
+        }
+
+        co_return Res;
+    }
+
+    string CharacterEntryText(int CharacterIndex) const {
+        return CharacterDescriptions() + "\n\n"
+        + ConversationText() + "\n"
+        + Characters.Data[CharacterIndex].Name + ": \"";
+    }
+
     // Query the state of the conversation with a fixed set of options.
     string QueryMultipleChoice(string const& Query, std::vector<string> const& Options) {
+        string Res = OpenAI::Request(MultipleChoiceText(Query, Options), "\"", 2, 1.0, MultipleChoiceOptions(Options));
+        return Res;
+        auto it = std::find(Options.begin(), Options.end(), Res);
+        if (it != Options.end()) {
+            return Res;
+        }
+        return "";
+    }
+
+    Task<string> QueryMultipleChoiceTask(string Query, std::vector<string> Options) {
+        co_return co_await OpenAI::RequestTask(MultipleChoiceText(Query, Options), "\"", 2, 1.0, MultipleChoiceOptions(Options));
+    }
+
+    // As QueryMultipleChoice, without waiting for the answer. Usually run in
+    // the background, so by default it gives way to replies being watched.
+    std::future<string> QueryMultipleChoiceAsync(string const& Query, std::vector<string> const& Options, RequestPriority Priority = RequestPriority::Deferred) {
+        return OpenAI::RequestAsync(MultipleChoiceText(Query, Options), "\"", 2, 1.0, MultipleChoiceOptions(Options, Priority));
+    }
+
+    // Stops receiving as soon as the answer is one of the options
+    static CompletionOptions MultipleChoiceOptions(std::vector<string> const& Options, RequestPriority Priority = RequestPriority::Interactive) {
+        CompletionOptions Res;
+        Res.Priority = Priority;
+        Res.StopAt = [Options](std::string_view Received) {
+            if (std::find(Options.begin(), Options.end(), Received) != Options.end()) {
+                return Received.size();
+            }
+            return string::npos;
+        };
+        return Res;
+    }
+
+    string MultipleChoiceText(string const& Query, std::vector<string> const& Options) const {
         string QueryText = ConversationText();
         QueryText = "Below is a conversation, and a multiple choice question. After reading the conversation, select the best possibe answer.\n\n" + QueryText;
         QueryText += "\n\nQuestion: " + Query + "\n";
@@ -259,14 +213,7 @@ BeginTransferStruct(Conversation)
             QueryText += "\"" + Options[i] + ((i == Options.size() - 1) ? "\"" : "\", ");
         }
         QueryText += ". Which is the best? Answer in quotes: \"";
-
-        string Res = OpenAI::Request(QueryText, "\"", 2, 1.0);
-        return Res;
-        auto it = std::find(Options.begin(), Options.end(), Res);
-        if (it != Options.end()) {
-            return Res;
-        }
-        return "";
+        return QueryText;
     }
 
     BeginSend(Ctx)
@@ -293,12 +240,21 @@ int main(int argc, char** argv) {
     Convo.Characters.Data[1].Name = "Bob";
     Convo.Characters.Data[1].Description = "Bob is a regular person.";
 
+    // Connect while the user types the first line
+    std::thread Prewarm([]() {
+        OpenAI::Default().Prewarm();
+    });
+
     while (true) {
         string UserLine;
         std::cout << Convo.Characters.Data[1].Name << ": ";
         getline(std::cin, UserLine); 
         trim(UserLine);
 
+        if (Prewarm.joinable()) {
+            Prewarm.join();
+        }
+
         Convo.AddEntry(1, UserLine);
 
         system("clear");
@@ -308,16 +264,21 @@ int main(int argc, char** argv) {
         std::cout << Convo.Characters.Data[0].Name << ":";
         std::cout.flush();
 
-        string OtherResponse = Convo.CompleteCharacterEntry(0);
+        // The reply is printed as it streams in
+        std::cout << " \"";
+        std::cout.flush();
+        Convo.CompleteCharacterEntry(0, 32, [](std::string_view Token) {
+            std::cout << Token;
+            std::cout.flush();
+        });
+        std::cout << "\"\n";
 
-        string QueryTest = Convo.QueryMultipleChoice(
+        std::future<string> QueryTest = Convo.QueryMultipleChoiceAsync(
             "Has the conversation between " + Convo.Characters.Data[0].Name + " and " + Convo.Characters.Data[0].Name + " ended?",
             { "Yes", "No" }
         );
 
-        std::cout << " \"" << OtherResponse << "\"\n";
-
-        if (QueryTest == "Yes") {
+        if (QueryTest.get() == "Yes") {
             break;
         }
     }